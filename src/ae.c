@@ -63,6 +63,7 @@ aeEventLoop *aeCreateEventLoop(void) {
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
+    eventLoop->stats = NULL;
     if (aeApiCreate(eventLoop) == -1) {
         zfree(eventLoop);
         return NULL;
@@ -75,6 +76,7 @@ aeEventLoop *aeCreateEventLoop(void) {
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    aeDisableStats(eventLoop);
     aeApiFree(eventLoop);
     zfree(eventLoop);
 }
@@ -182,6 +184,40 @@ int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
     return AE_ERR; /* NO event with the specified ID found */
 }
 
+/* Account a callback of the given kind that started at start. It is a
+ * stall when it ran longer than the threshold, the callback address
+ * is reported so that it can be resolved with addr2line or a debugger.
+ * Stats may have been disabled by the callback itself. */
+#define AE_STATS_FILE 0
+#define AE_STATS_TIME 1
+#define AE_STATS_SCAN 2
+
+static void aeStatsProc(aeEventLoop *eventLoop, int type, unsigned long proc,
+        uint64_t start)
+{
+    static const char *kinds[] = {"file", "time", "timer scan"};
+    aeStats *stats = eventLoop->stats;
+    const char *kind = kinds[type];
+    long long usec;
+
+    if (stats == NULL) return;
+    usec = mqtt_hist_now() - start;
+    if (type == AE_STATS_FILE)
+        mqtt_hist_record(&stats->fileProc, usec);
+    else if (type == AE_STATS_TIME)
+        mqtt_hist_record(&stats->timeProc, usec);
+    else
+        mqtt_hist_record(&stats->timerScan, usec);
+    if (stats->stallThreshold && usec >= stats->stallThreshold) {
+        stats->stalls++;
+        if (stats->stallProc)
+            stats->stallProc(eventLoop, kind, proc, usec);
+        else
+            fprintf(stderr, "ae: %s callback %#lx stalled the loop for %lld us\n",
+                kind, proc, usec);
+    }
+}
+
 /* Search the first timer to fire.
  * This operation is useful to know how many time the select can be
  * put in sleep without to delay any event.
@@ -229,9 +265,18 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
             (now_sec == te->when_sec && now_ms >= te->when_ms))
         {
             int retval;
+            aeTimeProc *proc = te->timeProc;
+            uint64_t start = 0;
 
             id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
+            if (eventLoop->stats) {
+                mqtt_hist_record(&eventLoop->stats->lateness,
+                    ((now_sec - te->when_sec)*1000 + now_ms - te->when_ms)*1000);
+                start = mqtt_hist_now();
+            }
+            retval = proc(eventLoop, id, te->clientData);
+            if (start)
+                aeStatsProc(eventLoop, AE_STATS_TIME, (unsigned long)proc, start);
             processed++;
             /* After an event is processed our time event list may
              * no longer be the same, so we restart from head.
@@ -275,10 +320,13 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
 int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 {
     int processed = 0, numevents;
+    uint64_t start = 0, polled = 0, waited = 0;
 
     /* Nothing to do? return ASAP */
     if (!(flags & AE_TIME_EVENTS) && !(flags & AE_FILE_EVENTS)) return 0;
 
+    if (eventLoop->stats) start = mqtt_hist_now();
+
     /* Note that we want call select() even if there are no
      * file events to process as long as we want to process time
      * events, in order to sleep until the next time event is ready
@@ -289,8 +337,11 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
         aeTimeEvent *shortest = NULL;
         struct timeval tv, *tvp;
 
-        if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
+        if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT)) {
             shortest = aeSearchNearestTimer(eventLoop);
+            if (start)
+                aeStatsProc(eventLoop, AE_STATS_SCAN, 0, start);
+        }
         if (shortest) {
             long now_sec, now_ms;
 
@@ -320,23 +371,36 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             }
         }
 
+        if (start) polled = mqtt_hist_now();
         numevents = aeApiPoll(eventLoop, tvp);
+        if (start) waited = mqtt_hist_now() - polled;
         for (j = 0; j < numevents; j++) {
             aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
             int mask = eventLoop->fired[j].mask;
             int fd = eventLoop->fired[j].fd;
             int rfired = 0;
+            aeFileProc *proc;
 
 	    /* note the fe->mask & mask & ... code: maybe an already processed
              * event removed an element that fired and we still didn't
              * processed, so we check if the event is still valid. */
             if (fe->mask & mask & AE_READABLE) {
                 rfired = 1;
-                fe->rfileProc(eventLoop,fd,fe->clientData,mask);
+                proc = fe->rfileProc;
+                if (start) polled = mqtt_hist_now();
+                proc(eventLoop,fd,fe->clientData,mask);
+                if (start)
+                    aeStatsProc(eventLoop, AE_STATS_FILE, (unsigned long)proc, polled);
             }
             if (fe->mask & mask & AE_WRITABLE) {
-                if (!rfired || fe->wfileProc != fe->rfileProc)
-                    fe->wfileProc(eventLoop,fd,fe->clientData,mask);
+                if (!rfired || fe->wfileProc != fe->rfileProc) {
+                    proc = fe->wfileProc;
+                    if (start) polled = mqtt_hist_now();
+                    proc(eventLoop,fd,fe->clientData,mask);
+                    if (start)
+                        aeStatsProc(eventLoop, AE_STATS_FILE, (unsigned long)proc,
+                            polled);
+                }
             }
             processed++;
         }
@@ -345,6 +409,10 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
     if (flags & AE_TIME_EVENTS)
         processed += processTimeEvents(eventLoop);
 
+    if (start && eventLoop->stats)
+        mqtt_hist_record(&eventLoop->stats->iteration,
+            mqtt_hist_now() - start - waited);
+
     return processed; /* return the number of processed file/time events */
 }
 
@@ -388,3 +456,38 @@ char *aeGetApiName(void) {
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
     eventLoop->beforesleep = beforesleep;
 }
+
+/* Start timing iterations and callbacks. Callbacks running for
+ * stallThreshold microseconds or more are stalls, reported to stallProc
+ * or to stderr when it is NULL. Enabling again only changes the
+ * threshold and the proc. While disabled the loop pays one NULL check
+ * per callback. */
+int aeEnableStats(aeEventLoop *eventLoop, long long stallThreshold,
+        aeStallProc *stallProc)
+{
+    aeStats *stats = eventLoop->stats;
+
+    if (stats == NULL) {
+        stats = zmalloc(sizeof(*stats));
+        if (stats == NULL) return AE_ERR;
+        mqtt_hist_reset(&stats->iteration);
+        mqtt_hist_reset(&stats->fileProc);
+        mqtt_hist_reset(&stats->timeProc);
+        mqtt_hist_reset(&stats->timerScan);
+        mqtt_hist_reset(&stats->lateness);
+        stats->stalls = 0;
+        eventLoop->stats = stats;
+    }
+    stats->stallThreshold = stallThreshold;
+    stats->stallProc = stallProc;
+    return AE_OK;
+}
+
+void aeDisableStats(aeEventLoop *eventLoop) {
+    zfree(eventLoop->stats);
+    eventLoop->stats = NULL;
+}
+
+aeStats *aeGetStats(aeEventLoop *eventLoop) {
+    return eventLoop->stats;
+}
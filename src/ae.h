@@ -33,6 +33,8 @@
 #ifndef __AE_H
 #define __AE_H
 
+#include "hist.h"
+
 #define AE_SETSIZE (1024*10)    /* Max number of fd supported */
 
 #define AE_OK 0
@@ -59,6 +61,8 @@ typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientData,
 typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop, void *clientData);
 typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
+typedef void aeStallProc(struct aeEventLoop *eventLoop, const char *kind,
+        unsigned long proc, long long usec);
 
 /* File event structure */
 typedef struct aeFileEvent {
@@ -85,6 +89,20 @@ typedef struct aeFiredEvent {
     int mask;
 } aeFiredEvent;
 
+/* Optional instrumentation, see aeEnableStats(). Durations are in
+ * microseconds, timer lateness has the millisecond resolution of the
+ * deadlines. */
+typedef struct aeStats {
+    MqttHist iteration; /* one aeProcessEvents() call, poll wait excluded */
+    MqttHist fileProc; /* file event callbacks */
+    MqttHist timeProc; /* time event callbacks */
+    MqttHist timerScan; /* search of the nearest timer, O(N) */
+    MqttHist lateness; /* time events fired after their deadline */
+    long long stallThreshold; /* 0 = no stall detection */
+    long long stalls;
+    aeStallProc *stallProc; /* NULL logs to stderr */
+} aeStats;
+
 /* State of an event based program */
 typedef struct aeEventLoop {
     int maxfd;
@@ -95,6 +113,7 @@ typedef struct aeEventLoop {
     int stop;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
+    aeStats *stats; /* NULL unless enabled */
 } aeEventLoop;
 
 /* Prototypes */
@@ -113,5 +132,9 @@ int aeWait(int fd, int mask, long long milliseconds);
 void aeMain(aeEventLoop *eventLoop);
 char *aeGetApiName(void);
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
+int aeEnableStats(aeEventLoop *eventLoop, long long stallThreshold,
+        aeStallProc *stallProc);
+void aeDisableStats(aeEventLoop *eventLoop);
+aeStats *aeGetStats(aeEventLoop *eventLoop);
 
 #endif
@@ -85,6 +85,21 @@ int anetNonBlock(char *err, int fd)
     return ANET_OK;
 }
 
+int anetBlock(char *err, int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL)) == -1) {
+        anetSetError(err, "fcntl(F_GETFL): %s", strerror(errno));
+        return ANET_ERR;
+    }
+    if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        anetSetError(err, "fcntl(F_SETFL,~O_NONBLOCK): %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+}
+
 int anetTcpNoDelay(char *err, int fd)
 {
     int yes = 1;
@@ -106,6 +121,137 @@ int anetSetSendBuffer(char *err, int fd, int buffsize)
     return ANET_OK;
 }
 
+int anetSetRecvBuffer(char *err, int fd, int buffsize)
+{
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffsize, sizeof(buffsize)) == -1)
+    {
+        anetSetError(err, "setsockopt SO_RCVBUF: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+}
+
+/* Set TCP keep alive option to detect dead peers. The interval option
+ * is only used for Linux as we are using Linux-specific APIs to set
+ * the probe send time, interval, and count. */
+int anetKeepAlive(char *err, int fd, int interval)
+{
+    int val = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val)) == -1)
+    {
+        anetSetError(err, "setsockopt SO_KEEPALIVE: %s", strerror(errno));
+        return ANET_ERR;
+    }
+
+#ifdef __linux__
+    /* Send first probe after interval. */
+    val = interval;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &val, sizeof(val)) < 0) {
+        anetSetError(err, "setsockopt TCP_KEEPIDLE: %s", strerror(errno));
+        return ANET_ERR;
+    }
+
+    /* Send next probes after the specified interval. Note that we set the
+     * delay as interval / 3, as we send three probes before detecting
+     * an error (see the next setsockopt call). */
+    val = interval/3;
+    if (val == 0) val = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &val, sizeof(val)) < 0) {
+        anetSetError(err, "setsockopt TCP_KEEPINTVL: %s", strerror(errno));
+        return ANET_ERR;
+    }
+
+    /* Consider the socket in error state after three we send three ACK
+     * probes without getting a reply. */
+    val = 3;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &val, sizeof(val)) < 0) {
+        anetSetError(err, "setsockopt TCP_KEEPCNT: %s", strerror(errno));
+        return ANET_ERR;
+    }
+#else
+    ((void) interval); /* Avoid unused var warning for non Linux systems. */
+#endif
+
+    return ANET_OK;
+}
+
+/* Busy poll the device queue for up to usecs on blocking reads and
+ * poll, trading CPU for latency. Linux only. */
+int anetBusyPoll(char *err, int fd, int usecs)
+{
+#ifdef SO_BUSY_POLL
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1)
+    {
+        anetSetError(err, "setsockopt SO_BUSY_POLL: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+#else
+    ((void) fd);
+    ((void) usecs);
+    anetSetError(err, "SO_BUSY_POLL not supported");
+    return ANET_ERR;
+#endif
+}
+
+/* Ack right away instead of delaying. The kernel may fall back to
+ * delayed acks, so callers re-arm this after reads. Linux only. */
+int anetTcpQuickAck(char *err, int fd)
+{
+#ifdef TCP_QUICKACK
+    int yes = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &yes, sizeof(yes)) == -1)
+    {
+        anetSetError(err, "setsockopt TCP_QUICKACK: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+#else
+    ((void) fd);
+    anetSetError(err, "TCP_QUICKACK not supported");
+    return ANET_ERR;
+#endif
+}
+
+/* Report the socket writable only while less than bytes are unsent. */
+int anetTcpNotSentLowat(char *err, int fd, int bytes)
+{
+#ifdef TCP_NOTSENT_LOWAT
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes)) == -1)
+    {
+        anetSetError(err, "setsockopt TCP_NOTSENT_LOWAT: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+#else
+    ((void) fd);
+    ((void) bytes);
+    anetSetError(err, "TCP_NOTSENT_LOWAT not supported");
+    return ANET_ERR;
+#endif
+}
+
+/* Hold back partial frames while corked, uncorking sends them. */
+int anetTcpCork(char *err, int fd, int on)
+{
+#if defined(TCP_CORK)
+    if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == -1)
+#elif defined(TCP_NOPUSH)
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on)) == -1)
+#else
+    ((void) fd);
+    ((void) on);
+    errno = ENOTSUP;
+    if (1)
+#endif
+    {
+        anetSetError(err, "setsockopt TCP_CORK: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+}
+
 int anetTcpKeepAlive(char *err, int fd)
 {
     int yes = 1;
@@ -51,8 +51,16 @@ int anetTcpAccept(char *err, int serversock, char *ip, int *port);
 int anetUnixAccept(char *err, int serversock);
 int anetWrite(int fd, char *buf, int count);
 int anetNonBlock(char *err, int fd);
+int anetBlock(char *err, int fd);
 int anetTcpNoDelay(char *err, int fd);
 int anetTcpKeepAlive(char *err, int fd);
+int anetKeepAlive(char *err, int fd, int interval);
+int anetSetSendBuffer(char *err, int fd, int buffsize);
+int anetSetRecvBuffer(char *err, int fd, int buffsize);
+int anetBusyPoll(char *err, int fd, int usecs);
+int anetTcpQuickAck(char *err, int fd);
+int anetTcpNotSentLowat(char *err, int fd, int bytes);
+int anetTcpCork(char *err, int fd, int on);
 int anetPeerToString(int fd, char *ip, int *port);
 int anetUdpServer(char *err, char *bindaddr, int port);
 int anetUdpSend(char *adrr, int port, char *buf, int count);
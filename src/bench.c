@@ -0,0 +1,381 @@
+/*
+ *
+ * bench.c - codec microbenchmarks.
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "ae.h"
+#include "mqtt.h"
+#include "mqtt_private.h"
+#include "packet.h"
+#include "zmalloc.h"
+
+//each case runs at least this long
+#define BENCH_MIN_NS 200000000ULL
+
+#define BENCH_MAX_PAYLOAD (1024*1024)
+
+#define BENCH_TOPIC "sensors/building-7/floor-3/room-42/temperature"
+
+#define BENCH_MIX_COUNT 1000
+
+typedef struct {
+	int size; //payload size of the case, 0 when it has none
+	char *buf; //encoded packet or scratch space
+	int buflen;
+	char *payload;
+	int sizes[BENCH_MIX_COUNT]; //payload sizes of the mix case
+	Mqtt *mqtt; //builds and reads the packets, it has no socket
+} Bench;
+
+typedef size_t (*BenchFunc)(Bench *bench, long long n);
+
+//results go here so that the work is not optimized out
+static volatile size_t sink;
+
+static uint64_t
+bench_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Run func with growing counts until it takes BENCH_MIN_NS, then report
+ * the last run. func returns the bytes it went through.
+ */
+static void
+bench_run(const char *name, Bench *bench, BenchFunc func) {
+	long long n = 1;
+	uint64_t start, elapsed;
+	size_t allocs, bytes;
+	char size[16] = "-";
+	func(bench, 1); //warm up
+	for(;;) {
+		allocs = zmalloc_alloc_count();
+		start = bench_ns();
+		bytes = func(bench, n);
+		elapsed = bench_ns() - start;
+		allocs = zmalloc_alloc_count() - allocs;
+		if(elapsed >= BENCH_MIN_NS || n >= (1LL << 40)) break;
+		n = elapsed < BENCH_MIN_NS / 100 ? n * 10 : n * 2;
+	}
+	if(bench->size < 0) {
+		strcpy(size, "mix");
+	} else if(bench->size >= 1024*1024) {
+		snprintf(size, sizeof(size), "%dM", bench->size / (1024*1024));
+	} else if(bench->size >= 1024) {
+		snprintf(size, sizeof(size), "%dK", bench->size / 1024);
+	} else if(bench->size > 0) {
+		snprintf(size, sizeof(size), "%d", bench->size);
+	}
+	printf("%-28s %6s %12.1f %12.1f %10.2f\n", name, size,
+		(double)elapsed / n,
+		bytes ? bytes * 1e3 / elapsed : 0.0,
+		(double)allocs / n);
+}
+
+/*--------------------------------------
+** Primitives.
+--------------------------------------*/
+static const int lengths[4] = {100, 10000, 1000000, 200000000};
+
+static size_t
+bench_encode_remaining_length(Bench *bench, long long n) {
+	long long i;
+	size_t total = 0;
+	for(i = 0; i < n; i++) {
+		total += _encode_remaining_length(bench->buf, lengths[i & 3]);
+	}
+	return total;
+}
+
+static size_t
+bench_decode_remaining_length(Bench *bench, long long n) {
+	long long i;
+	int count;
+	size_t bytes = 0, total = 0;
+	char *ptr;
+	for(i = 0; i < n; i++) {
+		ptr = bench->buf + (i & 3) * 4;
+		total += _decode_remaining_length(&ptr, &count);
+		bytes += count;
+	}
+	sink = total;
+	return bytes;
+}
+
+static size_t
+bench_read_string_len(Bench *bench, long long n) {
+	long long i;
+	int len;
+	char *ptr, *string;
+	for(i = 0; i < n; i++) {
+		ptr = bench->buf;
+		string = _read_string_len(&ptr, &len);
+		zfree(string);
+	}
+	sink = len;
+	return (size_t)n * (2 + len);
+}
+
+/*--------------------------------------
+** Packets, built and read by mqtt.c.
+--------------------------------------*/
+
+//queued by the client builder, then dropped as if written
+static size_t
+bench_publish_encode(Bench *bench, long long n) {
+	long long i;
+	size_t bytes = 0;
+	MqttMsg msg = {42, MQTT_QOS1, false, false, BENCH_TOPIC, bench->size, bench->payload, 0};
+	for(i = 0; i < n; i++) {
+		mqtt_encode_publish(bench->mqtt, &msg);
+		bytes += mqtt_output_take(bench->mqtt, NULL, 0);
+	}
+	return bytes;
+}
+
+static size_t
+bench_publish_mix_encode(Bench *bench, long long n) {
+	long long i;
+	size_t bytes = 0;
+	MqttMsg msg = {42, MQTT_QOS1, false, false, BENCH_TOPIC, 0, bench->payload, 0};
+	for(i = 0; i < n; i++) {
+		msg.payloadlen = bench->sizes[i % BENCH_MIX_COUNT];
+		mqtt_encode_publish(bench->mqtt, &msg);
+		bytes += mqtt_output_take(bench->mqtt, NULL, 0);
+	}
+	return bytes;
+}
+
+/*
+ * Through the client reader: framing, decode and the message struct.
+ * Without a socket QoS 1 is not acked.
+ */
+static size_t
+bench_publish_reader(Bench *bench, long long n) {
+	long long i;
+	for(i = 0; i < n; i++) {
+		mqtt_feed(bench->mqtt, bench->buf, bench->buflen);
+	}
+	return (size_t)n * bench->buflen;
+}
+
+//the packet is copied out of the output queue to be fed back
+static size_t
+bench_publish_mix_reader(Bench *bench, long long n) {
+	long long i;
+	size_t len, bytes = 0;
+	MqttMsg msg = {42, MQTT_QOS1, false, false, BENCH_TOPIC, 0, bench->payload, 0};
+	for(i = 0; i < n; i++) {
+		msg.payloadlen = bench->sizes[i % BENCH_MIX_COUNT];
+		mqtt_encode_publish(bench->mqtt, &msg);
+		len = mqtt_output_take(bench->mqtt, bench->buf, BENCH_MAX_PAYLOAD + 1024);
+		mqtt_feed(bench->mqtt, bench->buf, len);
+		bytes += len;
+	}
+	return bytes;
+}
+
+static size_t
+bench_subscribe_encode(Bench *bench, long long n) {
+	long long i;
+	size_t bytes = 0;
+	for(i = 0; i < n; i++) {
+		mqtt_encode_subscribe(bench->mqtt, 7, BENCH_TOPIC, MQTT_QOS1);
+		bytes += mqtt_output_take(bench->mqtt, NULL, 0);
+	}
+	return bytes;
+}
+
+//as a broker reads it, every filter with its qos, the client has no decoder for it
+static size_t
+bench_subscribe_decode(Bench *bench, long long n) {
+	long long i;
+	size_t bytes = 0;
+	char *ptr, *end, *topic;
+	int count, len, topiclen, qos = 0;
+	for(i = 0; i < n; i++) {
+		ptr = bench->buf;
+		_read_header(&ptr);
+		len = _decode_remaining_length(&ptr, &count);
+		end = ptr + len;
+		_read_int(&ptr);
+		while(ptr < end) {
+			topic = _read_string_len(&ptr, &topiclen);
+			qos += _read_char(&ptr);
+			zfree(topic);
+		}
+		bytes += 1 + count + len;
+	}
+	sink = qos;
+	return bytes;
+}
+
+static size_t
+bench_connect_encode(Bench *bench, long long n) {
+	long long i;
+	size_t bytes = 0;
+	for(i = 0; i < n; i++) {
+		mqtt_encode_connect(bench->mqtt);
+		bytes += mqtt_output_take(bench->mqtt, NULL, 0);
+	}
+	return bytes;
+}
+
+//as a broker reads it, the client has no CONNECT decoder
+static size_t
+bench_connect_decode(Bench *bench, long long n) {
+	long long i;
+	size_t bytes = 0;
+	char *ptr, *name, *clientid, *username, *password;
+	int count, len, keepalive = 0;
+	uint8_t flags;
+	for(i = 0; i < n; i++) {
+		ptr = bench->buf;
+		_read_header(&ptr);
+		len = _decode_remaining_length(&ptr, &count);
+		name = _read_string(&ptr);
+		_read_char(&ptr);
+		flags = _read_char(&ptr);
+		keepalive += _read_int(&ptr);
+		clientid = _read_string(&ptr);
+		username = password = NULL;
+		if(flags & 0x80) username = _read_string(&ptr);
+		if(flags & 0x40) password = _read_string(&ptr);
+		zfree(name);
+		zfree(clientid);
+		zfree(username);
+		zfree(password);
+		bytes += 1 + count + len;
+	}
+	sink = keepalive;
+	return bytes;
+}
+
+/*--------------------------------------
+** Main.
+--------------------------------------*/
+
+/*
+ * Mostly small messages with a long tail: 70% 16-256B, 25% 1-4KB,
+ * 4.9% 64KB and 0.1% 1MB, in a fixed order.
+ */
+static void
+bench_mix_init(Bench *bench) {
+	int i, r;
+	unsigned int seed = 42;
+	for(i = 0; i < BENCH_MIX_COUNT; i++) {
+		seed = seed * 1103515245 + 12345;
+		r = (seed >> 16) % 1000;
+		if(r < 700) {
+			bench->sizes[i] = 16 << (r % 5);
+		} else if(r < 950) {
+			bench->sizes[i] = 1024 << (r % 3);
+		} else if(r < 999) {
+			bench->sizes[i] = 64*1024;
+		} else {
+			bench->sizes[i] = BENCH_MAX_PAYLOAD;
+		}
+	}
+	bench->sizes[BENCH_MIX_COUNT / 2] = BENCH_MAX_PAYLOAD;
+}
+
+int
+main(void) {
+	static const int sizes[] = {16, 256, 4096, 65536, BENCH_MAX_PAYLOAD};
+	unsigned int i;
+	Bench bench;
+	aeEventLoop *el = aeCreateEventLoop();
+
+	memset(&bench, 0, sizeof(bench));
+	bench.buf = zmalloc(BENCH_MAX_PAYLOAD + 1024);
+	bench.payload = zmalloc(BENCH_MAX_PAYLOAD);
+	for(i = 0; i < BENCH_MAX_PAYLOAD; i++) bench.payload[i] = i % 251;
+	bench.mqtt = mqtt_new(el);
+	mqtt_set_protocol(bench.mqtt, MQTT_PROTO_V311);
+	mqtt_set_clientid(bench.mqtt, "mqttc-bench-0123456789");
+	mqtt_set_username(bench.mqtt, "bench");
+	mqtt_set_passwd(bench.mqtt, "secret");
+	mqtt_set_keepalive(bench.mqtt, 60);
+	bench_mix_init(&bench);
+
+	printf("%-28s %6s %12s %12s %10s\n", "benchmark", "size", "ns/op", "MB/s", "allocs/op");
+
+	bench_run("encode_remaining_length", &bench, bench_encode_remaining_length);
+	for(i = 0; i < 4; i++) _encode_remaining_length(bench.buf + i * 4, lengths[i]);
+	bench_run("decode_remaining_length", &bench, bench_decode_remaining_length);
+	for(i = 0; i < 3; i++) {
+		bench.size = sizes[i];
+		memset(bench.buf, 'x', sizes[i] + 2);
+		bench.buf[0] = MSB(sizes[i]);
+		bench.buf[1] = LSB(sizes[i]);
+		bench_run("read_string_len", &bench, bench_read_string_len);
+	}
+
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		bench.size = sizes[i];
+		bench_run("publish_encode", &bench, bench_publish_encode);
+	}
+	bench.size = -1;
+	bench_run("publish_encode", &bench, bench_publish_mix_encode);
+
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		MqttMsg msg = {42, MQTT_QOS1, false, false, BENCH_TOPIC, sizes[i], bench.payload, 0};
+		bench.size = sizes[i];
+		mqtt_encode_publish(bench.mqtt, &msg);
+		bench.buflen = mqtt_output_take(bench.mqtt, bench.buf, BENCH_MAX_PAYLOAD + 1024);
+		bench_run("publish_reader", &bench, bench_publish_reader);
+	}
+	bench.size = -1;
+	bench_run("publish_encode+reader", &bench, bench_publish_mix_reader);
+
+	bench.size = 0;
+	bench_run("subscribe_encode", &bench, bench_subscribe_encode);
+	mqtt_encode_subscribe(bench.mqtt, 7, BENCH_TOPIC, MQTT_QOS1);
+	mqtt_output_take(bench.mqtt, bench.buf, BENCH_MAX_PAYLOAD + 1024);
+	bench_run("subscribe_decode", &bench, bench_subscribe_decode);
+	bench_run("connect_encode", &bench, bench_connect_encode);
+	mqtt_encode_connect(bench.mqtt);
+	mqtt_output_take(bench.mqtt, bench.buf, BENCH_MAX_PAYLOAD + 1024);
+	bench_run("connect_decode", &bench, bench_connect_decode);
+
+	mqtt_release(bench.mqtt);
+	aeDeleteEventLoop(el);
+	zfree(bench.buf);
+	zfree(bench.payload);
+	return 0;
+}
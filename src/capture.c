@@ -0,0 +1,192 @@
+/* 
+ * capture.c - wire capture files
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#if defined(__sun__)
+#define _POSIX_C_SOURCE 200112L
+#elif defined(__linux__)
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "zmalloc.h"
+#include "capture.h"
+
+#define CAPTURE_VERSION 1
+#define CAPTURE_CHUNK (1024*1024)
+#define CAPTURE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+static uint64_t
+_capture_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Grow the file and its mapping to hold at least need bytes. The file
+ * is extended in chunks, so remapping is rare.
+ */
+static int
+_capture_reserve(MqttCapture *cap, size_t need) {
+	size_t size = cap->size;
+	char *map;
+	if(need <= size) return 0;
+	while(size < need) size = size ? size * 2 : CAPTURE_CHUNK;
+	if(ftruncate(cap->fd, size) < 0) return -1;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, 0);
+	if(map == MAP_FAILED) return -1;
+	if(cap->map) munmap(cap->map, cap->size);
+	cap->map = map;
+	cap->size = size;
+	return 0;
+}
+
+MqttCapture *
+mqtt_capture_create(const char *path, int protocol) {
+	MqttCaptureHeader *hdr;
+	MqttCapture *cap = zmalloc(sizeof(MqttCapture));
+	memset(cap, 0, sizeof(MqttCapture));
+	cap->writing = 1;
+	cap->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(cap->fd < 0 || _capture_reserve(cap, sizeof(MqttCaptureHeader)) < 0) {
+		mqtt_capture_close(cap);
+		return NULL;
+	}
+	hdr = (MqttCaptureHeader *)cap->map;
+	memcpy(hdr->magic, MQTT_CAPTURE_MAGIC, sizeof(hdr->magic));
+	hdr->version = CAPTURE_VERSION;
+	hdr->protocol = protocol;
+	hdr->start_time = _capture_ns(CLOCK_REALTIME);
+	cap->len = sizeof(MqttCaptureHeader);
+	cap->start_ns = _capture_ns(CLOCK_MONOTONIC);
+	return cap;
+}
+
+int
+mqtt_capture_append(MqttCapture *cap, int dir, const struct iovec *iov, int iovcnt, size_t len) {
+	int i;
+	size_t n, left = len;
+	char *ptr;
+	MqttCaptureRecord *rec;
+	size_t need = cap->len + sizeof(MqttCaptureRecord) + CAPTURE_ALIGN(len);
+	if(_capture_reserve(cap, need) < 0) return -1;
+	rec = (MqttCaptureRecord *)(cap->map + cap->len);
+	rec->ns = _capture_ns(CLOCK_MONOTONIC) - cap->start_ns;
+	rec->len = len;
+	rec->dir = dir;
+	memset(rec->reserved, 0, sizeof(rec->reserved));
+	ptr = (char *)(rec + 1);
+	for(i = 0; i < iovcnt && left > 0; i++) {
+		n = iov[i].iov_len < left ? iov[i].iov_len : left;
+		memcpy(ptr, iov[i].iov_base, n);
+		ptr += n;
+		left -= n;
+	}
+	cap->len = need;
+	return 0;
+}
+
+MqttCapture *
+mqtt_capture_open(const char *path) {
+	struct stat st;
+	MqttCapture *cap = zmalloc(sizeof(MqttCapture));
+	memset(cap, 0, sizeof(MqttCapture));
+	cap->fd = open(path, O_RDONLY);
+	if(cap->fd < 0 || fstat(cap->fd, &st) < 0) {
+		mqtt_capture_close(cap);
+		return NULL;
+	}
+	if((size_t)st.st_size < sizeof(MqttCaptureHeader)) {
+		mqtt_capture_close(cap);
+		errno = EINVAL;
+		return NULL;
+	}
+	cap->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, cap->fd, 0);
+	if(cap->map == MAP_FAILED) {
+		cap->map = NULL;
+		mqtt_capture_close(cap);
+		return NULL;
+	}
+	cap->size = cap->len = st.st_size;
+	if(memcmp(cap->map, MQTT_CAPTURE_MAGIC, 8) ||
+		((MqttCaptureHeader *)cap->map)->version != CAPTURE_VERSION) {
+		mqtt_capture_close(cap);
+		errno = EINVAL;
+		return NULL;
+	}
+	cap->pos = sizeof(MqttCaptureHeader);
+	return cap;
+}
+
+const MqttCaptureHeader *
+mqtt_capture_header(MqttCapture *cap) {
+	return (const MqttCaptureHeader *)cap->map;
+}
+
+const MqttCaptureRecord *
+mqtt_capture_next(MqttCapture *cap, const char **data) {
+	const MqttCaptureRecord *rec;
+	if(cap->pos + sizeof(MqttCaptureRecord) > cap->len) return NULL;
+	rec = (const MqttCaptureRecord *)(cap->map + cap->pos);
+	//zero filled tail or a record cut short, the writer died before closing
+	if(rec->dir == 0) return NULL;
+	if(cap->pos + sizeof(MqttCaptureRecord) + rec->len > cap->len) return NULL;
+	*data = (const char *)(rec + 1);
+	cap->pos += sizeof(MqttCaptureRecord) + CAPTURE_ALIGN(rec->len);
+	return rec;
+}
+
+void
+mqtt_capture_rewind(MqttCapture *cap) {
+	cap->pos = sizeof(MqttCaptureHeader);
+}
+
+int
+mqtt_capture_close(MqttCapture *cap) {
+	int status = 0;
+	if(cap->map) munmap(cap->map, cap->size);
+	if(cap->fd >= 0) {
+		//a file left longer ends in zeros, readers stop there
+		if(cap->writing && cap->map && ftruncate(cap->fd, cap->len) < 0) status = -1;
+		close(cap->fd);
+	}
+	zfree(cap);
+	return status;
+}
@@ -0,0 +1,96 @@
+/* 
+ * capture.h - wire capture files
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef __MQTT_CAPTURE_H
+#define __MQTT_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define MQTT_CAPTURE_MAGIC "MQTTCAP1"
+
+#define MQTT_CAPTURE_READ 1 //bytes read from the broker
+#define MQTT_CAPTURE_WRITE 2 //bytes written to the broker
+
+/*
+ * Capture file: this header, then records up to the end of the file.
+ * Every record is followed by len bytes as they crossed the socket,
+ * padded to 8 bytes. All fields are in host byte order.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint8_t protocol; //MQTT protocol level of the connection
+	uint8_t reserved[3];
+	uint64_t start_time; //wall clock at creation, ns since the epoch
+} MqttCaptureHeader;
+
+typedef struct {
+	uint64_t ns; //since the capture was created
+	uint32_t len;
+	uint8_t dir;
+	uint8_t reserved[3];
+} MqttCaptureRecord;
+
+/*
+ * A capture file mapped in memory, for writing or for reading.
+ */
+typedef struct _MqttCapture {
+	int fd;
+	int writing;
+	char *map;
+	size_t size; //mapped
+	size_t len; //used, or the file length when reading
+	size_t pos; //next record when reading
+	uint64_t start_ns; //monotonic clock at creation
+} MqttCapture;
+
+//create or truncate path, NULL with errno set on failure
+MqttCapture *mqtt_capture_create(const char *path, int protocol);
+
+//append what a writev of len bytes over iov sent, 0 or -1 with errno set
+int mqtt_capture_append(MqttCapture *cap, int dir, const struct iovec *iov, int iovcnt, size_t len);
+
+//map path for reading, NULL with errno set on failure
+MqttCapture *mqtt_capture_open(const char *path);
+
+const MqttCaptureHeader *mqtt_capture_header(MqttCapture *cap);
+
+//next record and its bytes, NULL at the end of the file
+const MqttCaptureRecord *mqtt_capture_next(MqttCapture *cap, const char **data);
+
+void mqtt_capture_rewind(MqttCapture *cap);
+
+//unmap, a written file is cut to the bytes used, -1 when that failed
+int mqtt_capture_close(MqttCapture *cap);
+
+#endif /* __MQTT_CAPTURE_H */
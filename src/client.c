@@ -53,6 +53,8 @@
 #include "ae.h"
 #include "anet.h"
 #include "mqtt.h"
+#include "hist.h"
+#include "capture.h"
 #include "zmalloc.h"
 #include "packet.h"
 #include "client.h"
@@ -61,17 +63,29 @@
 
 static Client client;
 
+//set by SIGUSR2, the cron dumps the packet trace
+static volatile sig_atomic_t trace_requested = 0;
+
 static const char *PROMPT = "mqttc> ";
 
-static const char *COMMANDS[3] = {
+static const char *COMMANDS[5] = {
 	"publish topic qos message\n",
 	"subscribe topic qos\n",
-	"unsubscribe topic\n"
+	"unsubscribe topic\n",
+	"latency [reset]\n",
+	"stats\n"
 };
 
 static void
 print_usage() {
-	printf("usage: mqttc -h host -p port -u username -P password -k keepalive\n");
+	printf("usage: mqttc -h host[:port],...|unix:/path -p port -u username -P password -k keepalive -V 3.1|3.1.1|5 -s sockopts -T cafile[,certfile[,keyfile]] -r -t size -w file | -R file [-F] [-x speed]\n");
+	printf("sockopts: nodelay,quickack,cork,sndbuf=N,rcvbuf=N,keepalive=N,busypoll=N,lowat=N\n");
+	printf("-T: talk TLS, cafile - takes the system CAs\n");
+	printf("-r: race connects to the two best servers of the list\n");
+	printf("-t: trace the last size packet events, kill -USR2 dumps them to mqttc-<pid>.trace\n");
+	printf("-w: capture the bytes read and written into file\n");
+	printf("-R: replay what was read into the decoder, -F: replay what was written to the broker\n");
+	printf("-x: replay speed, 1 is as recorded (default), 0 as fast as possible\n");
 }
 
 static void 
@@ -85,24 +99,71 @@ print_help() {
 	const char *cmd;
 	const char *help = "commands are: \n";
 	write(STDOUT_FILENO, help, strlen(help));
-	for(i = 0; i < 3; i++) {
+	for(i = 0; i < 5; i++) {
 		cmd = COMMANDS[i];
 		write(STDOUT_FILENO, cmd, strlen(cmd));
 	}
 }
 
+static void
+print_latency(const char *name, const MqttHist *hist) {
+	printf("%s: count=%llu p50=%lluus p99=%lluus max=%lluus\n", name,
+		(unsigned long long)hist->count,
+		(unsigned long long)mqtt_hist_percentile(hist, 50),
+		(unsigned long long)mqtt_hist_percentile(hist, 99),
+		(unsigned long long)hist->max);
+}
+
+static void
+print_stats(Mqtt *mqtt) {
+	int type;
+	MqttStats stats;
+	mqtt_get_stats(mqtt, &stats);
+	for(type = 1; type < 16; type++) {
+		if(!stats.packets_in[type] && !stats.packets_out[type]) continue;
+		printf("type %2d: in=%llu (%llu bytes) out=%llu (%llu bytes)\n", type,
+			(unsigned long long)stats.packets_in[type],
+			(unsigned long long)stats.bytes_in[type],
+			(unsigned long long)stats.packets_out[type],
+			(unsigned long long)stats.bytes_out[type]);
+	}
+	printf("messages=%llu reconnects=%llu decode_errors=%llu callback_us=%llu\n",
+		(unsigned long long)stats.messages,
+		(unsigned long long)stats.reconnects,
+		(unsigned long long)stats.decode_errors,
+		(unsigned long long)stats.callback_us);
+	printf("acks_pending=%d acks_owed=%d output_bytes=%zu\n",
+		stats.acks_pending, stats.acks_owed, stats.output_bytes);
+}
+
 static int 
 client_cron(aeEventLoop *el, long long id, void *clientData) {
 	Client *client = (Client *)clientData;
+	char path[64];
 	_NOTUSED(el);
 	_NOTUSED(id);
     if(client->shutdown_asap) {
 		printf("mqttc is shutdown...");
         aeStop(el);
     }
+	if(trace_requested) {
+		trace_requested = 0;
+		snprintf(path, sizeof(path), "mqttc-%d.trace", (int)getpid());
+		if(mqtt_trace_dump(client->mqtt, path) == MQTT_OK) {
+			printf("trace dumped to %s\n", path);
+		} else {
+			printf("trace dump failed: %s\n", client->mqtt->errstr);
+		}
+	}
     return 1000;
 }
 
+static void
+on_sigusr2(int sig) {
+	_NOTUSED(sig);
+	trace_requested = 1;
+}
+
 static void
 client_prepare() {
     srand(time(NULL)^getpid());
@@ -128,11 +189,19 @@ client_init() {
 	el = aeCreateEventLoop();
 	client.el = el;
 	client.mqtt = mqtt_new(el);
+	//the stats command shows callback_us
+	mqtt_set_callback_timing(client.mqtt, true);
 	client.shutdown_asap = false;
+	client.capture = NULL;
+	client.replay = NULL;
+	client.forward = false;
+	client.speed = 1;
 	mqtt_init(client.mqtt);
 
     signal(SIGCHLD, SIG_IGN);
-    //signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR2, on_sigusr2);
+    //a broker gone away is a write error, not the end of mqttc
+    signal(SIGPIPE, SIG_IGN);
 
     aeCreateTimeEvent(el, 100, client_cron, &client, NULL);
 }
@@ -145,7 +214,12 @@ on_connect(Mqtt *mqtt, void *data, int state) {
 		printf("mqttc is connecting to %s:%d...\n", mqtt->server, mqtt->port);
 		break;
 	case MQTT_STATE_CONNECTED:
-		printf("mqttc is connected.\n");
+		if(mqtt->tls) {
+			printf("mqttc is connected over tls%s.\n",
+				mqtt_tls_session_resumed(mqtt) ? ", session resumed" : "");
+		} else {
+			printf("mqttc is connected.\n");
+		}
 		print_prompt();
 		break;
 	case MQTT_STATE_DISCONNECTED:
@@ -168,7 +242,8 @@ on_publish(Mqtt *mqtt, void *data, int msgid) {
 	_NOTUSED(mqtt);
 	_NOTUSED(msgid);
 	MqttMsg *msg = (MqttMsg *)data;
-	printf("publish to %s: %s\n", msg->topic, msg->payload);
+	printf("publish to %s: %.*s\n", msg->topic,
+		msg->payload ? msg->payloadlen : 0, msg->payload ? msg->payload : "");
 }
 
 static void 
@@ -305,7 +380,6 @@ client_read(aeEventLoop *el, int fd, void *clientdata, int mask) {
 	const char *badcmd = "Invalid Command. try 'help'\n";
 	int argc;
 	char *argv[1024];
-	MqttMsg *msg;
 	_NOTUSED(el);
 	_NOTUSED(mask);
 	_NOTUSED(clientdata);
@@ -333,13 +407,19 @@ client_read(aeEventLoop *el, int fd, void *clientdata, int mask) {
 	} else if(!strncmp(buffer, "publish ", strlen("publish "))) {
 		argc = setargs(buffer+strlen("publish "), argv);
 		if(argc == 3) {
-			msg = mqtt_msg_new(0, atoi(argv[1]), false, false,
-				zstrdup(argv[0]), strlen(argv[2]), zstrdup(argv[2]));
-			mqtt_publish(client.mqtt, msg);
-			mqtt_msg_free(msg);
+			mqtt_publish_raw(client.mqtt, argv[0], strlen(argv[0]),
+				argv[2], strlen(argv[2]), atoi(argv[1]), false);
 		} else {
 			print_help();
 		}
+	} else if(!strncmp(buffer, "latency", strlen("latency"))) {
+		print_latency("ping", mqtt_get_ping_latency(client.mqtt));
+		print_latency("publish", mqtt_get_publish_latency(client.mqtt));
+		if(!strncmp(buffer, "latency reset", strlen("latency reset"))) {
+			mqtt_reset_latency(client.mqtt);
+		}
+	} else if(!strncmp(buffer, "stats", strlen("stats"))) {
+		print_stats(client.mqtt);
 	} else if (!strncmp(buffer, "\n", 1)){
 		//ignore
 	} else {
@@ -353,15 +433,86 @@ client_open() {
 	aeCreateFileEvent(client.el, STDIN_FILENO, AE_READABLE, client_read, &client);
 }
 
+static int
+parse_sockopts(char *spec, MqttSockOpts *opts) {
+	char *name, *value, *save = NULL;
+	for(name = strtok_r(spec, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		value = strchr(name, '=');
+		if(value) *value++ = '\0';
+		if(!strcmp(name, "nodelay")) {
+			opts->nodelay = true;
+		} else if(!strcmp(name, "quickack")) {
+			opts->quickack = true;
+		} else if(!strcmp(name, "cork")) {
+			opts->cork = true;
+		} else if(value && !strcmp(name, "sndbuf")) {
+			opts->sndbuf = atoi(value);
+		} else if(value && !strcmp(name, "rcvbuf")) {
+			opts->rcvbuf = atoi(value);
+		} else if(value && !strcmp(name, "keepalive")) {
+			opts->keepalive = atoi(value);
+		} else if(value && !strcmp(name, "busypoll")) {
+			opts->busy_poll = atoi(value);
+		} else if(value && !strcmp(name, "lowat")) {
+			opts->notsent_lowat = atoi(value);
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+//cafile[,certfile[,keyfile]], cafile - for the system CAs
+static int
+parse_tls(Mqtt *mqtt, char *spec) {
+	char *save = NULL;
+	char *cafile = strtok_r(spec, ",", &save);
+	char *certfile = strtok_r(NULL, ",", &save);
+	char *keyfile = strtok_r(NULL, ",", &save);
+	if(cafile && !strcmp(cafile, "-")) cafile = NULL;
+	return mqtt_set_tls(mqtt, cafile, certfile, keyfile);
+}
+
+//host[:port],... into the failover list
+static void
+parse_servers(Mqtt *mqtt, char *spec) {
+	char *host, *port, *save = NULL;
+	for(host = strtok_r(spec, ",", &save); host; host = strtok_r(NULL, ",", &save)) {
+		port = strncmp(host, "unix:", 5) ? strrchr(host, ':') : NULL;
+		if(port) *port++ = '\0';
+		mqtt_add_server(mqtt, host, port ? atoi(port) : mqtt->port);
+	}
+}
+
 static void
 client_setup(int argc, char **argv) {
 	char c;
+	char *servers = NULL;
 	Mqtt *mqtt = client.mqtt;
-	while ((c = getopt(argc, argv, "Hh:p:u:P:k:")) != -1) {
+	MqttSockOpts opts;
+	while ((c = getopt(argc, argv, "Hh:p:u:P:k:V:s:T:rt:w:R:Fx:")) != -1) {
         switch (c) {
         case 'h':
-			mqtt_set_server(mqtt, optarg);
+			servers = optarg;
             break;
+		case 'r':
+			mqtt_set_connect_race(mqtt, true);
+			break;
+		case 't':
+			mqtt_set_trace(mqtt, atoi(optarg));
+			break;
+		case 'w':
+			client.capture = optarg;
+			break;
+		case 'R':
+			client.replay = optarg;
+			break;
+		case 'F':
+			client.forward = true;
+			break;
+		case 'x':
+			client.speed = atof(optarg);
+			break;
         case 'p':
 			mqtt_set_port(mqtt, atoi(optarg));
             break;
@@ -374,12 +525,168 @@ client_setup(int argc, char **argv) {
 		case 'k':
 			mqtt_set_keepalive(mqtt, atoi(optarg));
 			break;
+		case 'V':
+			if(!strcmp(optarg, "3.1")) {
+				mqtt_set_protocol(mqtt, MQTT_PROTO_V31);
+			} else if(!strcmp(optarg, "3.1.1")) {
+				mqtt_set_protocol(mqtt, MQTT_PROTO_V311);
+			} else if(!strcmp(optarg, "5") || !strcmp(optarg, "5.0")) {
+				mqtt_set_protocol(mqtt, MQTT_PROTO_V5);
+			} else {
+				print_usage();
+				exit(-1);
+			}
+			break;
+		case 's':
+			memset(&opts, 0, sizeof(opts));
+			if(parse_sockopts(optarg, &opts) < 0) {
+				print_usage();
+				exit(-1);
+			}
+			mqtt_set_sockopts(mqtt, &opts);
+			break;
+		case 'T':
+			if(parse_tls(mqtt, optarg) != MQTT_OK) {
+				printf("mqttc: %s\n", mqtt->errstr);
+				exit(-1);
+			}
+			break;
 		case 'H':
             print_usage();
 			exit(0);
 		}
     }
-	if(!mqtt->server) mqtt_set_server(mqtt, "localhost");
+	//after -p, the default port of hosts without one
+	if(servers) parse_servers(mqtt, servers);
+	if(!servers) mqtt_set_server(mqtt, "localhost");
+	//after -V, the file records the protocol level
+	if(client.capture && mqtt_set_capture(mqtt, client.capture) != MQTT_OK) {
+		printf("mqttc: %s\n", mqtt->errstr);
+		exit(-1);
+	}
+}
+
+/*
+ * Replay of a capture file. Read records go into the decoder of the
+ * client, or with -F written records go to the broker while whatever
+ * it answers is dropped. The recorded gaps are divided by the speed.
+ */
+typedef struct {
+	MqttCapture *cap;
+	const MqttCaptureRecord *rec; //next to replay
+	const char *data;
+	int fd; //broker with -F
+	uint64_t start; //us
+	long long records;
+	long long bytes;
+} Replay;
+
+static Replay replay;
+
+static int
+replay_record(const MqttCaptureRecord *rec, const char *data) {
+	if(client.forward) {
+		if(rec->dir != MQTT_CAPTURE_WRITE) return 0;
+		if(anetWrite(replay.fd, (char *)data, rec->len) != (int)rec->len) return -1;
+	} else {
+		if(rec->dir != MQTT_CAPTURE_READ) return 0;
+		if(mqtt_feed(client.mqtt, data, rec->len) != MQTT_OK) return -1;
+	}
+	replay.records++;
+	replay.bytes += rec->len;
+	return 0;
+}
+
+static void
+replay_report(void) {
+	MqttStats stats;
+	double secs = (mqtt_hist_now() - replay.start) / 1e6;
+	mqtt_get_stats(client.mqtt, &stats);
+	printf("replayed %lld records, %lld bytes in %.3fs: %.1f MB/s",
+		replay.records, replay.bytes, secs, secs > 0 ? replay.bytes / secs / 1e6 : 0);
+	if(!client.forward) {
+		printf(", %llu messages, %.0f msg/s, %llu decode errors",
+			(unsigned long long)stats.messages,
+			secs > 0 ? stats.messages / secs : 0,
+			(unsigned long long)stats.decode_errors);
+	}
+	printf("\n");
+}
+
+static int
+replay_cron(aeEventLoop *el, long long id, void *clientdata) {
+	uint64_t due, now;
+	_NOTUSED(id);
+	_NOTUSED(clientdata);
+	while(replay.rec) {
+		due = replay.start + (uint64_t)(replay.rec->ns / 1000 / client.speed);
+		now = mqtt_hist_now();
+		if(due > now) return (due - now + 999) / 1000;
+		if(replay_record(replay.rec, replay.data) < 0) {
+			printf("replay stopped: %s\n", client.forward ? strerror(errno) : client.mqtt->errstr);
+			break;
+		}
+		replay.rec = mqtt_capture_next(replay.cap, &replay.data);
+	}
+	aeStop(el);
+	return AE_NOMORE;
+}
+
+static void
+replay_drain(aeEventLoop *el, int fd, void *clientdata, int mask) {
+	char buffer[4096];
+	_NOTUSED(clientdata);
+	_NOTUSED(mask);
+	if(read(fd, buffer, sizeof(buffer)) <= 0) aeDeleteFileEvent(el, fd, AE_READABLE);
+}
+
+static int
+replay_connect(Mqtt *mqtt) {
+	int count, port = mqtt->port;
+	const char *host = mqtt->server;
+	const MqttServer *servers = mqtt_get_servers(mqtt, &count);
+	char addr[128], err[ANET_ERR_LEN];
+	int fd;
+	if(!host && count > 0) {
+		host = servers[0].host;
+		port = servers[0].port;
+	}
+	if(anetResolve(err, (char *)host, addr) != ANET_OK ||
+		(fd = anetTcpConnect(err, addr, port)) == ANET_ERR) {
+		printf("mqttc: %s\n", err);
+		return -1;
+	}
+	aeCreateFileEvent(client.el, fd, AE_READABLE, replay_drain, NULL);
+	return fd;
+}
+
+static int
+client_replay(void) {
+	replay.cap = mqtt_capture_open(client.replay);
+	if(!replay.cap) {
+		printf("mqttc: cannot replay %s: %s\n", client.replay, strerror(errno));
+		return -1;
+	}
+	replay.fd = -1;
+	if(client.forward && (replay.fd = replay_connect(client.mqtt)) < 0) {
+		mqtt_capture_close(replay.cap);
+		return -1;
+	}
+	mqtt_set_protocol(client.mqtt, mqtt_capture_header(replay.cap)->protocol);
+	replay.start = mqtt_hist_now();
+	replay.rec = mqtt_capture_next(replay.cap, &replay.data);
+	if(client.speed <= 0) {
+		for(; replay.rec; replay.rec = mqtt_capture_next(replay.cap, &replay.data)) {
+			if(replay_record(replay.rec, replay.data) < 0) break;
+		}
+	} else {
+		aeCreateTimeEvent(client.el, 0, replay_cron, NULL, NULL);
+		aeMain(client.el);
+	}
+	replay_report();
+	if(replay.fd >= 0) close(replay.fd);
+	mqtt_capture_close(replay.cap);
+	return 0;
 }
 
 int main(int argc, char **argv) {
@@ -390,6 +697,10 @@ int main(int argc, char **argv) {
 	//parse args
 	client_setup(argc, argv);
 
+	if(client.replay) {
+		return client_replay() < 0 ? 1 : 0;
+	}
+
 	//set stdin event
 	client_open();
 
@@ -403,6 +714,9 @@ int main(int argc, char **argv) {
 
 	mqtt_run(client.mqtt);
 
+	//cut the capture file to its records
+	mqtt_set_capture(client.mqtt, NULL);
+
 	return 0;
 }
 
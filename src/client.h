@@ -39,6 +39,10 @@ typedef struct _Client {
 	aeEventLoop *el;
 	Mqtt *mqtt;
 	bool shutdown_asap;
+	char *capture; //-w, capture file to write
+	char *replay; //-R, capture file to replay
+	bool forward; //-F, replay to the broker instead of the decoder
+	double speed; //-x, 0 replays as fast as possible
 } Client;
 
 #endif
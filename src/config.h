@@ -29,6 +29,11 @@
 #define HAVE_KQUEUE 1
 #endif
 
+/* Test for sendfile() */
+#ifdef __linux__
+#define HAVE_SENDFILE 1
+#endif
+
 /* Define aof_fsync to fdatasync() in Linux and fsync() for all the rest */
 #ifdef __linux__
 #define aof_fsync fdatasync
@@ -0,0 +1,350 @@
+/* 
+ * dispatch.c - worker threads for message callbacks
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#if defined(__sun__)
+#define _POSIX_C_SOURCE 200112L
+#elif defined(__linux__)
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ae.h"
+#include "anet.h"
+#include "zmalloc.h"
+#include "mqtt.h"
+#include "mqtt_private.h"
+#include "dispatch_private.h"
+
+#define DISPATCH_CACHELINE 64
+
+/*
+ * Single producer, single consumer ring of pointers. head is only
+ * written by the producer and tail by the consumer.
+ */
+typedef struct {
+	void **slots;
+	unsigned int mask;
+	char pad1[DISPATCH_CACHELINE];
+	unsigned int head;
+	char pad2[DISPATCH_CACHELINE];
+	unsigned int tail;
+	char pad3[DISPATCH_CACHELINE];
+} DispatchRing;
+
+/*
+ * A worker takes messages from its input ring and hands them back,
+ * done, on its output ring. Only the loop thread allocates or frees.
+ */
+typedef struct {
+	MqttDispatch *dispatch;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int sleeping;
+	DispatchRing input;
+	DispatchRing output; //MqttMsg, with the ack flag in bit 0
+} DispatchWorker;
+
+struct _MqttDispatch {
+	Mqtt *mqtt;
+	MqttDispatchHandler handler;
+	void *privdata;
+	int stop;
+	int signalled;
+	int pipe[2]; //workers wake the loop through it
+	int pending;
+	int stale; //handed out before the last connect
+	int queue_size;
+	int ring_size;
+	bool paused; //reading paused by us
+	int count;
+	DispatchWorker *workers;
+};
+
+static void
+_ring_init(DispatchRing *ring, unsigned int size) {
+	ring->slots = zmalloc(sizeof(void *) * size);
+	ring->mask = size - 1;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+static bool
+_ring_push(DispatchRing *ring, void *item) {
+	unsigned int head = ring->head;
+	if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask) return false;
+	ring->slots[head & ring->mask] = item;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	return true;
+}
+
+static void *
+_ring_pop(DispatchRing *ring) {
+	void *item;
+	unsigned int tail = ring->tail;
+	if(tail == __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)) return NULL;
+	item = ring->slots[tail & ring->mask];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return item;
+}
+
+static void
+_dispatch_wake_loop(MqttDispatch *dispatch) {
+	if(__atomic_exchange_n(&dispatch->signalled, 1, __ATOMIC_SEQ_CST)) return;
+	if(write(dispatch->pipe[1], "x", 1) < 0) {
+		//full pipe, the loop is already woken
+	}
+}
+
+static void *
+_dispatch_worker(void *arg) {
+	DispatchWorker *worker = arg;
+	MqttDispatch *dispatch = worker->dispatch;
+	MqttMsg *msg;
+	uintptr_t done;
+
+	while(!__atomic_load_n(&dispatch->stop, __ATOMIC_SEQ_CST)) {
+		msg = _ring_pop(&worker->input);
+		if(!msg) {
+			pthread_mutex_lock(&worker->lock);
+			__atomic_store_n(&worker->sleeping, 1, __ATOMIC_SEQ_CST);
+			while(!__atomic_load_n(&dispatch->stop, __ATOMIC_SEQ_CST) &&
+				!(msg = _ring_pop(&worker->input))) {
+				pthread_cond_wait(&worker->cond, &worker->lock);
+			}
+			__atomic_store_n(&worker->sleeping, 0, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&worker->lock);
+			if(!msg) break;
+		}
+		done = (uintptr_t)msg;
+		if(dispatch->handler(msg, dispatch->privdata) == MQTT_OK) done |= 1;
+		//never full: reading pauses before ring_size messages are out
+		_ring_push(&worker->output, (void *)done);
+		_dispatch_wake_loop(dispatch);
+	}
+	return NULL;
+}
+
+/*
+ * Stale messages still take ring slots, reading pauses on them too.
+ */
+static bool
+_dispatch_full(MqttDispatch *dispatch) {
+	return dispatch->pending >= dispatch->queue_size ||
+		dispatch->pending + dispatch->stale >= dispatch->ring_size;
+}
+
+static void
+_dispatch_resume(MqttDispatch *dispatch) {
+	if(dispatch->paused && dispatch->pending <= dispatch->queue_size / 2 &&
+		!_dispatch_full(dispatch)) {
+		dispatch->paused = false;
+		mqtt_read_backlog(dispatch->mqtt, false);
+	}
+}
+
+/*
+ * On the loop: ack and free what the workers finished. Messages of an
+ * earlier connection are only freed, the broker delivers them again.
+ */
+static void
+_dispatch_complete(MqttDispatch *dispatch) {
+	int i;
+	uintptr_t done;
+	MqttMsg *msg;
+
+	for(i = 0; i < dispatch->count; i++) {
+		while((done = (uintptr_t)_ring_pop(&dispatch->workers[i].output))) {
+			msg = (MqttMsg *)(done & ~(uintptr_t)1);
+			if(msg->epoch != dispatch->mqtt->epoch) {
+				dispatch->stale--;
+			} else {
+				if((done & 1) && msg->qos != MQTT_QOS0) {
+					mqtt_ack(dispatch->mqtt, msg);
+				} else {
+					mqtt_inbound_release(dispatch->mqtt, msg);
+				}
+				dispatch->pending--;
+			}
+			mqtt_msg_free(msg);
+		}
+	}
+	_dispatch_resume(dispatch);
+}
+
+static void
+_dispatch_readable(aeEventLoop *el, int fd, void *privdata, int mask) {
+	char buf[64];
+	MqttDispatch *dispatch = privdata;
+	((void) el);
+	((void) mask);
+	while(read(fd, buf, sizeof(buf)) > 0);
+	__atomic_store_n(&dispatch->signalled, 0, __ATOMIC_SEQ_CST);
+	_dispatch_complete(dispatch);
+}
+
+/*
+ * queue_size bounds the messages handed out and not yet done. Reading
+ * pauses when it is reached, so no ring ever fills. Rings get twice
+ * that, messages of the previous connection may still be queued.
+ */
+MqttDispatch *
+mqtt_dispatch_new(Mqtt *mqtt, int workers, int queue_size, MqttDispatchHandler handler, void *privdata) {
+	int i, err;
+	unsigned int size = 1;
+	MqttDispatch *dispatch;
+	DispatchWorker *worker;
+
+	if(workers < 1 || queue_size < 1 || mqtt->dispatch) return NULL;
+	while(size < (unsigned int)queue_size * 2) size <<= 1;
+
+	dispatch = zmalloc(sizeof(MqttDispatch));
+	dispatch->mqtt = mqtt;
+	dispatch->handler = handler;
+	dispatch->privdata = privdata;
+	dispatch->stop = 0;
+	dispatch->signalled = 0;
+	dispatch->pending = 0;
+	dispatch->stale = 0;
+	dispatch->queue_size = queue_size;
+	dispatch->ring_size = size;
+	dispatch->paused = false;
+	dispatch->count = 0;
+	if(pipe(dispatch->pipe) < 0) {
+		snprintf(mqtt->errstr, sizeof(mqtt->errstr), "dispatch pipe: %s", strerror(errno));
+		zfree(dispatch);
+		return NULL;
+	}
+	anetNonBlock(NULL, dispatch->pipe[0]);
+	anetNonBlock(NULL, dispatch->pipe[1]);
+	aeCreateFileEvent(mqtt->el, dispatch->pipe[0], AE_READABLE, _dispatch_readable, dispatch);
+
+	dispatch->workers = zmalloc(sizeof(DispatchWorker) * workers);
+	for(i = 0; i < workers; i++) {
+		worker = &dispatch->workers[i];
+		worker->dispatch = dispatch;
+		worker->sleeping = 0;
+		_ring_init(&worker->input, size);
+		_ring_init(&worker->output, size);
+		pthread_mutex_init(&worker->lock, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+		err = pthread_create(&worker->thread, NULL, _dispatch_worker, worker);
+		if(err) {
+			snprintf(mqtt->errstr, sizeof(mqtt->errstr), "dispatch thread: %s", strerror(err));
+			pthread_mutex_destroy(&worker->lock);
+			pthread_cond_destroy(&worker->cond);
+			zfree(worker->input.slots);
+			zfree(worker->output.slots);
+			mqtt_dispatch_release(dispatch);
+			return NULL;
+		}
+		dispatch->count++;
+	}
+
+	//acks wait for the workers
+	mqtt_set_manual_ack(mqtt, true);
+	mqtt->dispatch = dispatch;
+	return dispatch;
+}
+
+void
+mqtt_dispatch_push(MqttDispatch *dispatch, MqttMsg *msg) {
+	DispatchWorker *worker;
+	worker = &dispatch->workers[mqtt_topic_hash(msg->topic, strlen(msg->topic)) % dispatch->count];
+	_ring_push(&worker->input, msg);
+	if(__atomic_load_n(&worker->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&worker->lock);
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->lock);
+	}
+	dispatch->pending++;
+	if(!dispatch->paused && _dispatch_full(dispatch)) {
+		dispatch->paused = true;
+		mqtt_read_backlog(dispatch->mqtt, true);
+	}
+}
+
+void
+mqtt_dispatch_reset(MqttDispatch *dispatch) {
+	dispatch->stale += dispatch->pending;
+	dispatch->pending = 0;
+	_dispatch_resume(dispatch);
+}
+
+int
+mqtt_dispatch_pending(MqttDispatch *dispatch) {
+	return dispatch->pending;
+}
+
+void
+mqtt_dispatch_release(MqttDispatch *dispatch) {
+	int i;
+	MqttMsg *msg;
+	DispatchWorker *worker;
+
+	__atomic_store_n(&dispatch->stop, 1, __ATOMIC_SEQ_CST);
+	for(i = 0; i < dispatch->count; i++) {
+		worker = &dispatch->workers[i];
+		pthread_mutex_lock(&worker->lock);
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->lock);
+		pthread_join(worker->thread, NULL);
+	}
+	//ack what was done, drop the rest unacked
+	_dispatch_complete(dispatch);
+	for(i = 0; i < dispatch->count; i++) {
+		worker = &dispatch->workers[i];
+		while((msg = _ring_pop(&worker->input))) mqtt_msg_free(msg);
+		zfree(worker->input.slots);
+		zfree(worker->output.slots);
+		pthread_mutex_destroy(&worker->lock);
+		pthread_cond_destroy(&worker->cond);
+	}
+	aeDeleteFileEvent(dispatch->mqtt->el, dispatch->pipe[0], AE_READABLE);
+	close(dispatch->pipe[0]);
+	close(dispatch->pipe[1]);
+	if(dispatch->paused) mqtt_read_backlog(dispatch->mqtt, false);
+	if(dispatch->mqtt->dispatch == dispatch) {
+		dispatch->mqtt->dispatch = NULL;
+		mqtt_set_manual_ack(dispatch->mqtt, false);
+	}
+	zfree(dispatch->workers);
+	zfree(dispatch);
+}
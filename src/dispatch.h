@@ -0,0 +1,55 @@
+/* 
+ * dispatch.h - hand messages to worker threads, ordered per topic
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef __MQTT_DISPATCH_H
+#define __MQTT_DISPATCH_H
+
+#include "mqtt.h"
+
+typedef struct _MqttDispatch MqttDispatch;
+
+/*
+ * Runs on a worker thread. The message is read only and owned by the
+ * loop. Return MQTT_OK to ack it, anything else leaves it unacked so
+ * the broker delivers it again after a reconnect.
+ */
+typedef int (*MqttDispatchHandler)(const MqttMsg *msg, void *privdata);
+
+//start workers and route the messages of mqtt to them, by topic
+MqttDispatch *mqtt_dispatch_new(Mqtt *mqtt, int workers, int queue_size, MqttDispatchHandler handler, void *privdata);
+
+//messages handed out and not yet completed
+int mqtt_dispatch_pending(MqttDispatch *dispatch);
+
+//stop the workers, queued messages are dropped unacked
+void mqtt_dispatch_release(MqttDispatch *dispatch);
+
+#endif /* __MQTT_DISPATCH_H */
@@ -0,0 +1,207 @@
+/* 
+ * group.c - consumer group over shared subscriptions
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "ae.h"
+#include "zmalloc.h"
+#include "packet.h"
+#include "mqtt.h"
+#include "group.h"
+
+#define GROUP_SHARE_PREFIX "$share/"
+
+/*
+ * Counters are written on the member's loop and read from any thread
+ * by mqtt_group_stats, both sides use relaxed atomics.
+ */
+typedef struct {
+	MqttGroup *group;
+	int index;
+	Mqtt *mqtt;
+	long long messages;
+	long long bytes;
+	int connects;
+} GroupMember;
+
+struct _MqttGroup {
+	char *name;
+	MqttGroupHandler handler;
+	void *privdata;
+	int count;
+	GroupMember *members;
+};
+
+static void
+_group_on_message(Mqtt *mqtt, MqttMsg *msg) {
+	GroupMember *member = mqtt->userdata;
+	__atomic_fetch_add(&member->messages, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&member->bytes, msg->payloadlen, __ATOMIC_RELAXED);
+	member->group->handler(member->group, member->index, msg, member->group->privdata);
+}
+
+static void
+_group_on_connect(Mqtt *mqtt, void *data, int state) {
+	GroupMember *member = mqtt->userdata;
+	((void) data);
+	if(state == MQTT_STATE_CONNECTED) {
+		__atomic_fetch_add(&member->connects, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * $share/<group>/<filter>, zfree it.
+ */
+static char *
+_group_share_topic(MqttGroup *group, const char *filter) {
+	size_t len = strlen(GROUP_SHARE_PREFIX) + strlen(group->name) + 1 + strlen(filter) + 1;
+	char *topic = zmalloc(len);
+	snprintf(topic, len, GROUP_SHARE_PREFIX "%s/%s", group->name, filter);
+	return topic;
+}
+
+MqttGroup *
+mqtt_group_new(const char *group, const char *clientid, int members, aeEventLoop **loops, int nloops, MqttGroupHandler handler, void *privdata) {
+	int i;
+	size_t len;
+	char *id;
+	MqttGroup *g;
+	GroupMember *member;
+
+	if(members < 1 || nloops < 1 || !handler) return NULL;
+	//the group name is one topic level
+	if(!*group || strpbrk(group, "/+#")) return NULL;
+	if(!clientid) clientid = group;
+
+	g = zmalloc(sizeof(MqttGroup));
+	g->name = zstrdup(group);
+	g->handler = handler;
+	g->privdata = privdata;
+	g->count = members;
+	g->members = zmalloc(sizeof(GroupMember) * members);
+
+	len = strlen(clientid) + 16;
+	id = zmalloc(len);
+	for(i = 0; i < members; i++) {
+		member = &g->members[i];
+		member->group = g;
+		member->index = i;
+		member->messages = 0;
+		member->bytes = 0;
+		member->connects = 0;
+		member->mqtt = mqtt_new(loops[i % nloops]);
+		member->mqtt->userdata = member;
+		snprintf(id, len, "%s-%d", clientid, i);
+		mqtt_set_clientid(member->mqtt, id);
+		mqtt_set_msg_callback(member->mqtt, _group_on_message);
+		mqtt_set_callback(member->mqtt, CONNECT, _group_on_connect);
+	}
+	zfree(id);
+	return g;
+}
+
+int
+mqtt_group_size(MqttGroup *group) {
+	return group->count;
+}
+
+Mqtt *
+mqtt_group_member(MqttGroup *group, int member) {
+	if(member < 0 || member >= group->count) return NULL;
+	return group->members[member].mqtt;
+}
+
+/*
+ * Before connecting, the subscription is sent by the clean session
+ * replay once each member is up.
+ */
+int
+mqtt_group_subscribe(MqttGroup *group, const char *filter, uint8_t qos) {
+	int i;
+	char *topic = _group_share_topic(group, filter);
+	for(i = 0; i < group->count; i++) {
+		mqtt_subscribe(group->members[i].mqtt, topic, qos);
+	}
+	zfree(topic);
+	return MQTT_OK;
+}
+
+int
+mqtt_group_unsubscribe(MqttGroup *group, const char *filter) {
+	int i;
+	char *topic = _group_share_topic(group, filter);
+	for(i = 0; i < group->count; i++) {
+		mqtt_unsubscribe(group->members[i].mqtt, topic);
+	}
+	zfree(topic);
+	return MQTT_OK;
+}
+
+int
+mqtt_group_connect(MqttGroup *group) {
+	int i, n = 0;
+	for(i = 0; i < group->count; i++) {
+		if(mqtt_connect(group->members[i].mqtt) >= 0) n++;
+	}
+	return n;
+}
+
+void
+mqtt_group_disconnect(MqttGroup *group) {
+	int i;
+	for(i = 0; i < group->count; i++) {
+		mqtt_disconnect(group->members[i].mqtt);
+	}
+}
+
+void
+mqtt_group_stats(MqttGroup *group, int member, MqttGroupStats *stats) {
+	GroupMember *m;
+	memset(stats, 0, sizeof(MqttGroupStats));
+	if(member < 0 || member >= group->count) return;
+	m = &group->members[member];
+	stats->state = __atomic_load_n(&m->mqtt->state, __ATOMIC_RELAXED);
+	stats->messages = __atomic_load_n(&m->messages, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&m->bytes, __ATOMIC_RELAXED);
+	stats->connects = __atomic_load_n(&m->connects, __ATOMIC_RELAXED);
+}
+
+void
+mqtt_group_release(MqttGroup *group) {
+	int i;
+	for(i = 0; i < group->count; i++) {
+		mqtt_release(group->members[i].mqtt);
+	}
+	zfree(group->members);
+	zfree(group->name);
+	zfree(group);
+}
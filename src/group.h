@@ -0,0 +1,81 @@
+/* 
+ * group.h - consumer group over shared subscriptions
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef __MQTT_GROUP_H
+#define __MQTT_GROUP_H
+
+#include "ae.h"
+#include "mqtt.h"
+
+typedef struct _MqttGroup MqttGroup;
+
+/*
+ * Deliveries of every member, merged. member is the index of the
+ * connection the message came in on. With members on several loops
+ * it runs on each loop's thread.
+ */
+typedef void (*MqttGroupHandler)(MqttGroup *group, int member, MqttMsg *msg, void *privdata);
+
+typedef struct {
+	int state;
+	long long messages;
+	long long bytes;
+	int connects;
+} MqttGroupStats;
+
+/*
+ * members connections with client ids <clientid>-<n>, spread over
+ * nloops event loops. A NULL clientid takes the group name. The
+ * member's userdata belongs to the group.
+ */
+MqttGroup *mqtt_group_new(const char *group, const char *clientid, int members, aeEventLoop **loops, int nloops, MqttGroupHandler handler, void *privdata);
+
+int mqtt_group_size(MqttGroup *group);
+
+//configure a member (server, port, tls...) before connecting
+Mqtt *mqtt_group_member(MqttGroup *group, int member);
+
+//every member subscribes to $share/<group>/<filter>
+int mqtt_group_subscribe(MqttGroup *group, const char *filter, uint8_t qos);
+
+int mqtt_group_unsubscribe(MqttGroup *group, const char *filter);
+
+//connect every member, returns how many are connecting
+int mqtt_group_connect(MqttGroup *group);
+
+void mqtt_group_disconnect(MqttGroup *group);
+
+//safe to call from any thread, all zero for a bad member
+void mqtt_group_stats(MqttGroup *group, int member, MqttGroupStats *stats);
+
+void mqtt_group_release(MqttGroup *group);
+
+#endif /* __MQTT_GROUP_H */
@@ -0,0 +1,125 @@
+/* 
+ * hist.c - log-linear latency histogram
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#if defined(__sun__)
+#define _POSIX_C_SOURCE 200112L
+#elif defined(__linux__)
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE
+#endif
+
+#include <string.h>
+#include <time.h>
+
+#include "hist.h"
+
+#define HIST_SUB_COUNT (1 << MQTT_HIST_SUB_BITS)
+#define HIST_MAX_VALUE ((1ULL << MQTT_HIST_MAX_BITS) - 1)
+
+uint64_t
+mqtt_hist_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static int
+_hist_msb(uint64_t value) {
+	int msb = 0;
+	while(value >>= 1) msb++;
+	return msb;
+}
+
+static int
+_hist_index(uint64_t value) {
+	int shift;
+	if(value < HIST_SUB_COUNT) return (int)value;
+	shift = _hist_msb(value) - MQTT_HIST_SUB_BITS;
+	return ((shift + 1) << MQTT_HIST_SUB_BITS) + (int)(value >> shift) - HIST_SUB_COUNT;
+}
+
+static uint64_t
+_hist_upper(int index) {
+	int shift;
+	if(index < HIST_SUB_COUNT) return index;
+	shift = (index >> MQTT_HIST_SUB_BITS) - 1;
+	return ((uint64_t)(HIST_SUB_COUNT + (index & (HIST_SUB_COUNT - 1)) + 1) << shift) - 1;
+}
+
+void
+mqtt_hist_reset(MqttHist *hist) {
+	memset(hist, 0, sizeof(MqttHist));
+}
+
+void
+mqtt_hist_record(MqttHist *hist, uint64_t value) {
+	if(value > HIST_MAX_VALUE) value = HIST_MAX_VALUE;
+	hist->buckets[_hist_index(value)]++;
+	if(hist->count == 0 || value < hist->min) hist->min = value;
+	if(value > hist->max) hist->max = value;
+	hist->count++;
+	hist->sum += value;
+}
+
+uint64_t
+mqtt_hist_percentile(const MqttHist *hist, double p) {
+	int i;
+	uint64_t seen = 0, rank;
+	if(hist->count == 0) return 0;
+	rank = (uint64_t)(p / 100.0 * hist->count + 0.5);
+	if(rank < 1) rank = 1;
+	if(rank > hist->count) rank = hist->count;
+	for(i = 0; i < MQTT_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if(seen >= rank) break;
+	}
+	//never above what was seen
+	return _hist_upper(i) < hist->max ? _hist_upper(i) : hist->max;
+}
+
+double
+mqtt_hist_mean(const MqttHist *hist) {
+	return hist->count ? (double)hist->sum / hist->count : 0;
+}
+
+void
+mqtt_hist_merge(MqttHist *hist, const MqttHist *from) {
+	int i;
+	if(from->count == 0) return;
+	for(i = 0; i < MQTT_HIST_BUCKETS; i++) {
+		hist->buckets[i] += from->buckets[i];
+	}
+	if(hist->count == 0 || from->min < hist->min) hist->min = from->min;
+	if(from->max > hist->max) hist->max = from->max;
+	hist->count += from->count;
+	hist->sum += from->sum;
+}
@@ -0,0 +1,70 @@
+/* 
+ * hist.h - log-linear latency histogram
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef __MQTT_HIST_H
+#define __MQTT_HIST_H
+
+#include <stdint.h>
+
+/*
+ * Values below 2^MQTT_HIST_SUB_BITS have a bucket each, above that
+ * every power of two is split in 2^MQTT_HIST_SUB_BITS buckets, so a
+ * recorded value is off by at most 1/16 (6%). Values are clamped at
+ * 2^MQTT_HIST_MAX_BITS-1, about 19 hours in microseconds.
+ */
+#define MQTT_HIST_SUB_BITS 4
+#define MQTT_HIST_MAX_BITS 36
+#define MQTT_HIST_BUCKETS ((MQTT_HIST_MAX_BITS - MQTT_HIST_SUB_BITS + 1) << MQTT_HIST_SUB_BITS)
+
+typedef struct _MqttHist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint32_t buckets[MQTT_HIST_BUCKETS];
+} MqttHist;
+
+//monotonic clock in microseconds, the unit of the samples
+uint64_t mqtt_hist_now(void);
+
+void mqtt_hist_reset(MqttHist *hist);
+
+void mqtt_hist_record(MqttHist *hist, uint64_t value);
+
+//upper bound of the bucket holding the p-th percentile, 0 <= p <= 100
+uint64_t mqtt_hist_percentile(const MqttHist *hist, double p);
+
+double mqtt_hist_mean(const MqttHist *hist);
+
+//add every sample of from into hist
+void mqtt_hist_merge(MqttHist *hist, const MqttHist *from);
+
+#endif /* __MQTT_HIST_H */
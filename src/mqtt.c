@@ -29,6 +29,14 @@
  * POSSIBILITY OF SUCH DAMAGE.
  *
  */
+#if defined(__sun__)
+#define _POSIX_C_SOURCE 200112L
+#elif defined(__linux__)
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -41,12 +49,30 @@
 #include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <poll.h>
+
+#include "config.h"
+
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 #include "ae.h"
 #include "anet.h"
 #include "zmalloc.h"
 #include "packet.h"
 #include "mqtt.h"
+#include "mqtt_private.h"
+#include "dispatch_private.h"
+#include "hist.h"
+#include "trace.h"
+#include "capture.h"
+
+#ifdef MQTT_TLS
+#include "tls.h"
+#endif
 
 #define MAX_RETRIES 3
 
@@ -58,6 +84,49 @@
 
 #define MQTT_BUFFER_SIZE (1024*16)
 
+#define MQTT_RESUB_PACKET_SIZE 4096
+
+#define MQTT_MAX_PACKET_SIZE (1024*1024*16)
+
+#define MQTT_INFLIGHT_SIZE 64
+
+#define MQTT_RECEIVE_MAX 65535
+
+#define MQTT_TOPIC_ALIAS_MAX 256
+
+#define MQTT_OUTPUT_CHUNK (1024*16)
+
+#define MQTT_SENDFILE_CHUNK (1024*1024)
+
+#define MQTT_DRAIN_TIMEOUT 1000
+
+/*
+ * Stats, and the gauges mqtt_get_stats reads, have one writer, the loop
+ * thread, and readers on any thread. Relaxed atomic loads and stores
+ * keep each value whole without paying for a locked add.
+ */
+#define MQTT_STAT_ADD(counter, n) __atomic_store_n(&(counter), \
+	__atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+#define MQTT_STAT_SUB(counter, n) __atomic_store_n(&(counter), \
+	__atomic_load_n(&(counter), __ATOMIC_RELAXED) - (n), __ATOMIC_RELAXED)
+
+#define MQTT_STAT_SET(counter, n) __atomic_store_n(&(counter), (n), __ATOMIC_RELAXED)
+
+#define MQTT_STAT_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+#define MQTT_IOV_MAX 16
+
+#define MQTT_UNIX_PREFIX "unix:"
+
+#define MQTT_EWMA_WEIGHT 0.2
+
+#define MQTT_SERVER_UNKNOWN_MS 1000.0
+
+#define MQTT_FAILOVER_DELAY 100
+
+#define MQTT_RACE_TIMEOUT 10000
+
 /*
  * Why Buffer? May be used on resource limited os?
  */
@@ -69,20 +138,93 @@ mqtt_new(aeEventLoop *el) {
 
 	mqtt->el = el;
 	mqtt->state = MQTT_STATE_INIT;
+	mqtt->fd = -1;
 	mqtt->server = NULL;
 	mqtt->username = NULL;
 	mqtt->password = NULL;
 	mqtt->clientid = NULL;
 	mqtt->cleansess = true;
+	mqtt->protocol = MQTT_PROTO_V31;
+	mqtt->receive_max = 0;
+	mqtt->max_packet_size = 0;
+	mqtt->server_receive_max = MQTT_RECEIVE_MAX;
+	mqtt->server_max_packet_size = 0;
+	mqtt->topic_alias_max = 0;
+	mqtt->topic_aliases = NULL;
+	mqtt->topic_aliases_size = 0;
+	mqtt->aliases = NULL;
+	mqtt->alias_count = 0;
+	mqtt->alias_clock = 0;
+	mqtt->alias_seen = NULL;
+	mqtt->inflight = NULL;
+	mqtt->inflight_count = 0;
+	mqtt->inflight_size = 0;
+	mqtt->publish_timeout = 0;
+	mqtt->publish_timer = -1;
+	mqtt->keepalive_timer = -1;
+	mqtt->read_paused = false;
+	mqtt->read_throttled = false;
+	mqtt->read_backlog = false;
+	mqtt->inbound_pending = 0;
+	mqtt->inbound_held = 0;
+	mqtt->epoch = 0;
+	mqtt->read_high = 0;
+	mqtt->read_low = 0;
+	mqtt->resume_timer = -1;
 	mqtt->port = 1883;
 	mqtt->retries = MAX_RETRIES;
 	mqtt->error = 0;
 	mqtt->msgid = 1;
 	mqtt->keepalive = KEEPALIVE;
+	mqtt->will = NULL;
 	for(i = 0; i < 16; i++) {
 		mqtt->callbacks[i] = NULL;
 	}
 	mqtt->msgcallback = NULL;
+	mqtt->manual_ack = false;
+	mqtt->batchcallback = NULL;
+	mqtt->batch = NULL;
+	mqtt->batch_count = 0;
+	mqtt->batch_max = 0;
+	mqtt->batch_flushing = false;
+	mqtt->batch_resize = 0;
+	mqtt->callback_timing = false;
+	mqtt->streamcallback = NULL;
+	mqtt->stream_threshold = MQTT_BUFFER_SIZE;
+	mqtt->stream = NULL;
+	mqtt->stream_offset = 0;
+	mqtt->subs = NULL;
+	mqtt->rbuf = NULL;
+	mqtt->rlen = 0;
+	mqtt->rsize = 0;
+	mqtt->output = NULL;
+	mqtt->output_tail = NULL;
+	mqtt->output_bytes = 0;
+	mqtt->write_pending = false;
+	mqtt->tls = NULL;
+	mqtt->unix_sock = false;
+	mqtt->dispatch = NULL;
+	mqtt->servers = NULL;
+	mqtt->server_count = 0;
+	mqtt->server_current = -1;
+	mqtt->server_round = 0;
+	mqtt->connect_race = false;
+	mqtt->race_fds[0] = mqtt->race_fds[1] = -1;
+	mqtt->race_index[0] = mqtt->race_index[1] = -1;
+	mqtt->race_timer = -1;
+	mqtt->connect_start = 0;
+	mqtt->ping_sent = 0;
+	mqtt->reconnect_timer = -1;
+	mqtt->ping_latency = zmalloc(sizeof(MqttHist));
+	mqtt->publish_latency = zmalloc(sizeof(MqttHist));
+	mqtt_hist_reset(mqtt->ping_latency);
+	mqtt_hist_reset(mqtt->publish_latency);
+	mqtt->ping_probe = 0;
+	mqtt->probe_timer = -1;
+	memset(&mqtt->stats, 0, sizeof(mqtt->stats));
+	mqtt->trace = NULL;
+	mqtt->capture = NULL;
+	memset(&mqtt->sockopts, 0, sizeof(MqttSockOpts));
 	return mqtt;
 }
 
@@ -115,6 +257,26 @@ mqtt_set_port(Mqtt *mqtt, int port) {
 	mqtt->port = port;
 }
 
+void
+mqtt_set_protocol(Mqtt *mqtt, uint8_t protocol) {
+	mqtt->protocol = protocol;
+}
+
+void
+mqtt_set_receive_max(Mqtt *mqtt, int receive_max) {
+	mqtt->receive_max = receive_max;
+}
+
+void
+mqtt_set_max_packet_size(Mqtt *mqtt, int size) {
+	mqtt->max_packet_size = size;
+}
+
+void
+mqtt_set_topic_alias_max(Mqtt *mqtt, int max) {
+	mqtt->topic_alias_max = max;
+}
+
 void 
 mqtt_set_retries(Mqtt *mqtt, int retries) {
 	mqtt->retries = retries;
@@ -149,13 +311,36 @@ mqtt_set_callback(Mqtt *mqtt, uint8_t type, MqttCallback callback) {
 	mqtt->callbacks[type] = callback;
 }
 
+/*
+ * Time spent in callbacks goes to stats.callback_us, two clock reads
+ * per callback, only when asked for.
+ */
+void
+mqtt_set_callback_timing(Mqtt *mqtt, bool on) {
+	mqtt->callback_timing = on;
+}
+
+static uint64_t
+_mqtt_callback_start(Mqtt *mqtt) {
+	return mqtt->callback_timing ? mqtt_hist_now() : 0;
+}
+
+static void
+_mqtt_callback_end(Mqtt *mqtt, uint64_t start) {
+	if(start) MQTT_STAT_ADD(mqtt->stats.callback_us, mqtt_hist_now() - start);
+}
+
 static void 
 _mqtt_callback(Mqtt *mqtt, int type, void *data, int id) {
 	if(type < 0) return;
 	type = (type >> 4) & 0x0F;
 	if(type > 16) return;
 	MqttCallback cb = mqtt->callbacks[type];
-	if(cb) cb(mqtt, data, id);
+	uint64_t start;
+	if(!cb) return;
+	start = _mqtt_callback_start(mqtt);
+	cb(mqtt, data, id);
+	_mqtt_callback_end(mqtt, start);
 }
 
 void 
@@ -164,6 +349,16 @@ mqtt_clear_callback(Mqtt *mqtt, unsigned char type) {
 	mqtt->callbacks[type] = NULL;
 }
 
+/*
+ * In manual ack mode inbound QoS1/QoS2 messages are not acked until
+ * mqtt_ack() is called, so the broker redelivers whatever was not
+ * processed when the connection drops.
+ */
+void
+mqtt_set_manual_ack(Mqtt *mqtt, bool manual) {
+	mqtt->manual_ack = manual;
+}
+
 void 
 mqtt_set_msg_callback(Mqtt *mqtt, MqttMsgCallback callback) {
 	mqtt->msgcallback = callback;
@@ -171,7 +366,11 @@ mqtt_set_msg_callback(Mqtt *mqtt, MqttMsgCallback callback) {
 
 static void 
 _mqtt_msg_callback(Mqtt *mqtt, MqttMsg *msg) {
-	if(mqtt->msgcallback) mqtt->msgcallback(mqtt, msg);
+	uint64_t start;
+	if(!mqtt->msgcallback) return;
+	start = _mqtt_callback_start(mqtt);
+	mqtt->msgcallback(mqtt, msg);
+	_mqtt_callback_end(mqtt, start);
 }
 
 void 
@@ -179,6 +378,48 @@ mqtt_clear_msg_callback(Mqtt *mqtt) {
 	mqtt->msgcallback = NULL;
 }
 
+/*
+ * Publishes whose remaining length reaches threshold bytes are handed
+ * to callback in chunks as they are read, and never buffered whole.
+ */
+void
+mqtt_set_stream_callback(Mqtt *mqtt, MqttStreamCallback callback, int threshold) {
+	mqtt->streamcallback = callback;
+	mqtt->stream_threshold = (threshold > 0) ? threshold : MQTT_BUFFER_SIZE;
+}
+
+void
+mqtt_clear_stream_callback(Mqtt *mqtt) {
+	mqtt->streamcallback = NULL;
+}
+
+static void _mqtt_batch_flush(Mqtt *mqtt);
+
+/*
+ * Deliver inbound messages in arrays of up to max_batch, one call per
+ * read, instead of one msg callback per message.
+ */
+void
+mqtt_set_batch_msg_callback(Mqtt *mqtt, MqttBatchCallback callback, int max_batch) {
+	if(max_batch < 1) max_batch = 1;
+	//called from the batch callback, the array is still in use
+	if(mqtt->batch_flushing) {
+		mqtt->batch_resize = max_batch;
+		mqtt->batchcallback = callback;
+		return;
+	}
+	_mqtt_batch_flush(mqtt);
+	mqtt->batch = zrealloc(mqtt->batch, sizeof(MqttMsg *)*max_batch);
+	mqtt->batch_max = max_batch;
+	mqtt->batchcallback = callback;
+}
+
+void
+mqtt_clear_batch_msg_callback(Mqtt *mqtt) {
+	_mqtt_batch_flush(mqtt);
+	mqtt->batchcallback = NULL;
+}
+
 static void
 _mqtt_set_error(char *err, const char *fmt, ...) {
     va_list ap;
@@ -188,166 +429,1650 @@ _mqtt_set_error(char *err, const char *fmt, ...) {
     va_end(ap);
 }
 
-static void 
-_mqtt_send_connect(Mqtt *mqtt) {
-	int len = 0;
-	char *ptr, *buffer=NULL;
+static void _mqtt_sock_setup(Mqtt *mqtt, int fd);
 
-	uint8_t header = CONNECT;
-	uint8_t flags = 0;
+void
+mqtt_set_sockopts(Mqtt *mqtt, const MqttSockOpts *opts) {
+	mqtt->sockopts = *opts;
+	if(mqtt->fd >= 0) _mqtt_sock_setup(mqtt, mqtt->fd);
+}
 
-	int remaining_count = 0;
-	char remaining_length[4];
+static int _mqtt_inflight_timeout(aeEventLoop *el, long long id, void *clientdata);
 
-	//header
-	header = SETQOS(header, MQTT_QOS1);
-	
-	//flags
-	flags = FLAG_CLEANSESS(flags, mqtt->cleansess);
-	flags = FLAG_WILL(flags, (mqtt->will) ? 1 : 0);
-	if (mqtt->will) {
-		flags = FLAG_WILLQOS(flags, mqtt->will->qos);
-		flags = FLAG_WILLRETAIN(flags, mqtt->will->retain);
+/*
+ * Fail publishes not acked within timeout ms, 0 waits forever.
+ */
+void
+mqtt_set_publish_timeout(Mqtt *mqtt, int timeout) {
+	mqtt->publish_timeout = timeout;
+	if(mqtt->publish_timer != -1) {
+		aeDeleteTimeEvent(mqtt->el, mqtt->publish_timer);
+		mqtt->publish_timer = -1;
 	}
-	if (mqtt->username) flags = FLAG_USERNAME(flags, 1);
-	if (mqtt->password) flags = FLAG_PASSWD(flags, 1);
+	if(timeout > 0) {
+		mqtt->publish_timer = aeCreateTimeEvent(mqtt->el, timeout,
+			_mqtt_inflight_timeout, mqtt, NULL);
+	}
+}
 
-	//length
-	if(mqtt->clientid) {
-		len = 12 + 2 + strlen(mqtt->clientid);
+/*
+ * Talk TLS to the broker. cafile verifies the broker (system defaults
+ * when NULL), certfile and keyfile are an optional client certificate.
+ */
+int
+mqtt_set_tls(Mqtt *mqtt, const char *cafile, const char *certfile, const char *keyfile) {
+#ifdef MQTT_TLS
+	if(mqtt->tls) mqtt_tls_release(mqtt->tls);
+	mqtt->tls = mqtt_tls_new(mqtt->errstr, cafile, certfile, keyfile);
+	return mqtt->tls ? MQTT_OK : MQTT_ERR;
+#else
+	MQTT_NOTUSED(cafile);
+	MQTT_NOTUSED(certfile);
+	MQTT_NOTUSED(keyfile);
+	_mqtt_set_error(mqtt->errstr, "built without TLS, make USE_SSL=1");
+	return MQTT_ERR;
+#endif
+}
+
+/*
+ * Whether the current connection resumed a cached TLS session, without
+ * a full handshake.
+ */
+bool
+mqtt_tls_session_resumed(Mqtt *mqtt) {
+#ifdef MQTT_TLS
+	return mqtt->tls && mqtt->fd >= 0 && mqtt_tls_resumed(mqtt->tls);
+#else
+	MQTT_NOTUSED(mqtt);
+	return false;
+#endif
+}
+
+static long long
+_mqtt_mstime(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/*
+ * msgid is 16 bits and must never be zero.
+ */
+static int
+_mqtt_msgid(Mqtt *mqtt) {
+	int msgid = mqtt->msgid++;
+	if(mqtt->msgid > 0xFFFF) mqtt->msgid = 1;
+	return msgid;
+}
+
+/*--------------------------------------
+** MQTT subscription registry.
+--------------------------------------*/
+static MqttSub *
+_mqtt_sub_find(Mqtt *mqtt, const char *topic) {
+	MqttSub *sub;
+	for(sub = mqtt->subs; sub; sub = sub->next) {
+		if(!strcmp(sub->topic, topic)) return sub;
 	}
-	if(mqtt->will) {
-		len += 2 + strlen(mqtt->will->topic);
-		len += 2 + strlen(mqtt->will->msg);
+	return NULL;
+}
+
+static MqttSub *
+_mqtt_sub_add(Mqtt *mqtt, const char *topic, uint8_t qos) {
+	MqttSub **link;
+	MqttSub *sub = _mqtt_sub_find(mqtt, topic);
+	if(!sub) {
+		sub = zmalloc(sizeof(MqttSub));
+		sub->topic = zstrdup(topic);
+		sub->next = NULL;
+		//keep subscribe order, replay relies on it
+		for(link = &mqtt->subs; *link; link = &(*link)->next);
+		*link = sub;
 	}
-	if(mqtt->username) {
-		len += 2 + strlen(mqtt->username);
+	sub->qos = qos;
+	sub->msgid = 0;
+	sub->unsubid = 0;
+	return sub;
+}
+
+static void
+_mqtt_sub_remove(Mqtt *mqtt, MqttSub *sub) {
+	MqttSub **link;
+	for(link = &mqtt->subs; *link; link = &(*link)->next) {
+		if(*link == sub) {
+			*link = sub->next;
+			zfree(sub->topic);
+			zfree(sub);
+			return;
+		}
 	}
-	if(mqtt->password) {
-		len += 2 + strlen(mqtt->password);
+}
+
+static void
+_mqtt_sub_clear(Mqtt *mqtt) {
+	MqttSub *sub, *next;
+	for(sub = mqtt->subs; sub; sub = next) {
+		next = sub->next;
+		zfree(sub->topic);
+		zfree(sub);
 	}
-	
-	remaining_count = _encode_remaining_length(remaining_length, len);
+	mqtt->subs = NULL;
+}
 
-	ptr = buffer = zmalloc(1+remaining_count+len);
-	
-	_write_header(&ptr, header);
-	_write_remaining_length(&ptr, remaining_length, remaining_count);
-	_write_string_len(&ptr, PROTOCOL_MAGIC, 6);
-	_write_char(&ptr, MQTT_PROTO_MAJOR);
-	_write_char(&ptr, flags);
-	_write_int(&ptr, mqtt->keepalive);
-	_write_string(&ptr, mqtt->clientid);
+/*--------------------------------------
+** MQTT in-flight window.
+--------------------------------------*/
+/*
+ * Slots are indexed by msgid. msgids are allocated in sequence, so the
+ * table only grows when a publish is still unacked after the ids have
+ * wrapped around to its slot.
+ */
+static MqttInflight *
+_mqtt_inflight_find(Mqtt *mqtt, int msgid) {
+	MqttInflight *slot;
+	if(!msgid || !mqtt->inflight_size) return NULL;
+	slot = &mqtt->inflight[msgid & (mqtt->inflight_size-1)];
+	return (slot->id == msgid) ? slot : NULL;
+}
 
-	if(mqtt->will) {
-		_write_string(&ptr, mqtt->will->topic);
-		_write_string(&ptr, mqtt->will->msg);
+static void
+_mqtt_inflight_grow(Mqtt *mqtt) {
+	int i, size;
+	MqttInflight *old = mqtt->inflight;
+	size = mqtt->inflight_size ? mqtt->inflight_size*2 : MQTT_INFLIGHT_SIZE;
+	mqtt->inflight = zmalloc(sizeof(MqttInflight)*size);
+	memset(mqtt->inflight, 0, sizeof(MqttInflight)*size);
+	for(i = 0; i < mqtt->inflight_size; i++) {
+		if(old[i].id) mqtt->inflight[old[i].id & (size-1)] = old[i];
 	}
-	if (mqtt->username) {
-		_write_string(&ptr, mqtt->username);
+	mqtt->inflight_size = size;
+	if(old) zfree(old);
+}
+
+static MqttInflight *
+_mqtt_inflight_add(Mqtt *mqtt, int msgid, uint8_t qos) {
+	MqttInflight *slot = NULL;
+	while(!slot || slot->id) {
+		if(slot || !mqtt->inflight_size) _mqtt_inflight_grow(mqtt);
+		slot = &mqtt->inflight[msgid & (mqtt->inflight_size-1)];
 	}
-	if (mqtt->password) {
-		_write_string(&ptr, mqtt->password);
+	slot->id = msgid;
+	slot->qos = qos;
+	MQTT_STAT_ADD(mqtt->inflight_count, 1);
+	return slot;
+}
+
+static void
+_mqtt_inflight_remove(Mqtt *mqtt, MqttInflight *slot) {
+	slot->id = 0;
+	slot->callback = NULL;
+	MQTT_STAT_SUB(mqtt->inflight_count, 1);
+}
+
+/*
+ * Free every slot and call its completion with status, or only those
+ * sent before deadline when it is set. A failed publish gives its msgid
+ * and its share of the broker's window back, an ack arriving later finds
+ * no slot and is ignored. The msgids are taken first: callbacks may
+ * publish again and regrow the table, their new publishes are left alone.
+ */
+static void
+_mqtt_inflight_fail(Mqtt *mqtt, int status, uint64_t deadline) {
+	int i, n = 0, msgid, *ids;
+	MqttInflight *slot;
+	MqttPublishCallback callback;
+	void *ctx;
+	if(mqtt->inflight_count == 0) return;
+	ids = zmalloc(sizeof(int)*mqtt->inflight_count);
+	for(i = 0; i < mqtt->inflight_size; i++) {
+		slot = &mqtt->inflight[i];
+		if(!slot->id) continue;
+		if(deadline && slot->sent > deadline) continue;
+		ids[n++] = slot->id;
+	}
+	for(i = 0; i < n; i++) {
+		//gone when a callback failed or acked it already
+		slot = _mqtt_inflight_find(mqtt, ids[i]);
+		if(!slot) continue;
+		msgid = slot->id;
+		callback = slot->callback;
+		ctx = slot->ctx;
+		_mqtt_inflight_remove(mqtt, slot);
+		if(callback) callback(mqtt, msgid, status, ctx);
 	}
+	zfree(ids);
+}
 
-	anetWrite(mqtt->fd, buffer, ptr-buffer);
+static int
+_mqtt_inflight_timeout(aeEventLoop *el, long long id, void *clientdata) {
+	Mqtt *mqtt = (Mqtt *)clientdata;
+	MQTT_NOTUSED(el);
+	if(mqtt->inflight_count > 0) {
+		_mqtt_inflight_fail(mqtt, MQTT_ERR_TIMEOUT,
+			mqtt_hist_now() - (uint64_t)mqtt->publish_timeout*1000);
+	}
+	//a callback changed the timeout, this timer is gone
+	if(mqtt->publish_timer != id) return AE_NOMORE;
+	return mqtt->publish_timeout/4 > 1000 ? 1000 : mqtt->publish_timeout/4 + 1;
+}
 
-	zfree(buffer);
+static void
+_mqtt_inflight_clear(Mqtt *mqtt) {
+	_mqtt_inflight_fail(mqtt, MQTT_ERR_CONNLOST, 0);
 }
 
-static void _mqtt_read(aeEventLoop *el, int fd, void *privdata, int mask);
+/*--------------------------------------
+** MQTT 5 topic aliases.
+--------------------------------------*/
+uint32_t
+mqtt_topic_hash(const char *topic, int len) {
+	uint32_t hash = 2166136261u; //FNV-1a
+	while(len--) {
+		hash ^= (uint8_t)*topic++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
 
-int 
-mqtt_connect(Mqtt *mqtt) {
-    char server[1024] = {0};
-    if(anetResolve(mqtt->errstr, mqtt->server, server) != ANET_OK) {
-		return -1;
-    } 
-    int fd = anetTcpConnect(mqtt->errstr, server, mqtt->port);
-    if (fd < 0) {
-        return fd;
-    }
-    mqtt->fd = fd;
-    aeCreateFileEvent(mqtt->el, fd, AE_READABLE, (aeFileProc *)_mqtt_read, (void *)mqtt); 
-	_mqtt_send_connect(mqtt);
-    mqtt_set_state(mqtt, MQTT_STATE_CONNECTING);
-	_mqtt_callback(mqtt, CONNECT, NULL, MQTT_STATE_CONNECTING);
+/*
+ * Aliases only live as long as the network connection.
+ */
+static void
+_mqtt_alias_reset(Mqtt *mqtt, int count) {
+	int i;
+	if(mqtt->aliases) {
+		for(i = 0; i < mqtt->alias_count; i++) {
+			if(mqtt->aliases[i].topic) zfree(mqtt->aliases[i].topic);
+		}
+		zfree(mqtt->aliases);
+		mqtt->aliases = NULL;
+		zfree(mqtt->alias_seen);
+		mqtt->alias_seen = NULL;
+	}
+	if(mqtt->topic_aliases) {
+		for(i = 0; i < mqtt->topic_aliases_size; i++) {
+			if(mqtt->topic_aliases[i]) zfree(mqtt->topic_aliases[i]);
+		}
+		zfree(mqtt->topic_aliases);
+		mqtt->topic_aliases = NULL;
+	}
+	if(count > MQTT_TOPIC_ALIAS_MAX) count = MQTT_TOPIC_ALIAS_MAX;
+	mqtt->alias_count = count;
+	if(count > 0) {
+		mqtt->aliases = zmalloc(sizeof(MqttAlias)*count);
+		memset(mqtt->aliases, 0, sizeof(MqttAlias)*count);
+		mqtt->alias_seen = zmalloc(sizeof(uint32_t)*count);
+		memset(mqtt->alias_seen, 0, sizeof(uint32_t)*count);
+	}
+	mqtt->topic_aliases_size = 0;
+	if(mqtt->topic_alias_max > 0) {
+		mqtt->topic_aliases_size = mqtt->topic_alias_max+1;
+		mqtt->topic_aliases = zmalloc(sizeof(char *)*mqtt->topic_aliases_size);
+		memset(mqtt->topic_aliases, 0, sizeof(char *)*mqtt->topic_aliases_size);
+	}
+}
 
-    return fd;
+/*
+ * Find or assign the alias of an outbound topic. A topic seen before
+ * keeps its alias and *known is set, so only the alias goes on the
+ * wire. A new topic takes a free alias, and is sent in full once to
+ * establish the mapping. Once the table is full a topic must come back
+ * before it evicts the least recently used one, so one-off topics do
+ * not push out hot ones: the first time only its hash is remembered
+ * and 0 is returned, no alias.
+ */
+static int
+_mqtt_alias_out(Mqtt *mqtt, const char *topic, int topiclen, bool *known) {
+	int i, lru = 0;
+	MqttAlias *alias;
+	uint32_t *seen;
+	uint32_t hash = mqtt_topic_hash(topic, topiclen);
+	*known = false;
+	for(i = 0; i < mqtt->alias_count; i++) {
+		alias = &mqtt->aliases[i];
+		if(!alias->topic) {
+			lru = i;
+			break;
+		}
+		if(alias->hash == hash && alias->topiclen == topiclen &&
+			!memcmp(alias->topic, topic, topiclen)) {
+			alias->used = ++mqtt->alias_clock;
+			*known = true;
+			return i+1;
+		}
+		if(alias->used < mqtt->aliases[lru].used) lru = i;
+	}
+	alias = &mqtt->aliases[lru];
+	if(alias->topic) {
+		seen = &mqtt->alias_seen[hash % mqtt->alias_count];
+		if(*seen != hash) {
+			*seen = hash;
+			return 0;
+		}
+		*seen = 0;
+	}
+	if(alias->topic) zfree(alias->topic);
+	alias->topic = zmalloc(topiclen);
+	memcpy(alias->topic, topic, topiclen);
+	alias->topiclen = topiclen;
+	alias->hash = hash;
+	alias->used = ++mqtt->alias_clock;
+	return lru+1;
 }
 
-static int 
-_mqtt_reconnect(aeEventLoop *el, long long id, void *clientData)
-{
-    int fd;
-    int timeout;
-	MQTT_NOTUSED(id);
-    Mqtt *mqtt = (Mqtt*)clientData;
-    fd = mqtt_connect((Mqtt *)clientData);
-    if(fd < 0) {
-        if(mqtt->retries > MAX_RETRIES) {
-            mqtt->retries = 1;
-        } 
-        timeout = ((2 * mqtt->retries) * 60) * 1000;
-        aeCreateTimeEvent(el, timeout, _mqtt_reconnect, mqtt, NULL);
-        mqtt->retries++;
-    } else {
-        mqtt->retries = 1;
-    }
-    return AE_NOMORE;
+/*
+ * Resolve an inbound alias, recording the mapping when the topic is
+ * present. return NULL when the alias is unknown or out of range.
+ */
+static char *
+_mqtt_alias_in(Mqtt *mqtt, int alias, char *topic, int topiclen) {
+	if(alias < 1 || alias >= mqtt->topic_aliases_size) {
+		zfree(topic);
+		return NULL;
+	}
+	if(topiclen > 0) {
+		if(mqtt->topic_aliases[alias]) zfree(mqtt->topic_aliases[alias]);
+		mqtt->topic_aliases[alias] = zstrdup(topic);
+		return topic;
+	}
+	zfree(topic);
+	if(!mqtt->topic_aliases[alias]) return NULL;
+	return zstrdup(mqtt->topic_aliases[alias]);
 }
 
-static void 
-_mqtt_send_publish(Mqtt *mqtt, MqttMsg *msg) {
-	int len = 0;
-	char *ptr, *buffer;
-	char remaining_length[4];
-	int remaining_count;
+/*--------------------------------------
+** MQTT transport.
+--------------------------------------*/
+static bool
+_mqtt_host_is_unix(const char *host) {
+	return !strncmp(host, MQTT_UNIX_PREFIX, strlen(MQTT_UNIX_PREFIX));
+}
 
-	uint8_t header = PUBLISH;
-	header = SETRETAIN(header, msg->retain);
-	header = SETQOS(header, msg->qos);
-	header = SETDUP(header, msg->dup);
+static ssize_t
+_mqtt_sock_read(Mqtt *mqtt, char *buf, size_t len) {
+#ifdef MQTT_TLS
+	if(mqtt->tls && mqtt_tls_connected(mqtt->tls)) {
+		return mqtt_tls_read(mqtt->tls, buf, len);
+	}
+#endif
+	return read(mqtt->fd, buf, len);
+}
+
+/*
+ * Whether bytes can go to the socket as they are, so that writev and
+ * sendfile apply. Over TLS this takes kTLS.
+ */
+static bool
+_mqtt_sock_plain(Mqtt *mqtt) {
+#ifdef MQTT_TLS
+	return !mqtt->tls || !mqtt_tls_connected(mqtt->tls) ||
+		mqtt_tls_ktls_send(mqtt->tls);
+#else
+	MQTT_NOTUSED(mqtt);
+	return true;
+#endif
+}
+
+static ssize_t
+_mqtt_sock_writev(Mqtt *mqtt, const struct iovec *iov, int iovcnt) {
+#ifdef MQTT_TLS
+	if(!_mqtt_sock_plain(mqtt)) return mqtt_tls_writev(mqtt->tls, iov, iovcnt);
+#endif
+	return writev(mqtt->fd, iov, iovcnt);
+}
+
+/*--------------------------------------
+** MQTT output queue.
+--------------------------------------*/
+static void _mqtt_write_ready(aeEventLoop *el, int fd, void *privdata, int mask);
+
+/*
+ * Reserve len bytes at the tail of the output queue. Small packets share
+ * a chunk so that one writev sends many of them. The bytes count as
+ * queued right away, the caller must fill all of them.
+ */
+static char *
+_mqtt_output_reserve(Mqtt *mqtt, int len) {
+	char *ptr;
+	MqttOutput *out = mqtt->output_tail;
+	if(!out || out->fd >= 0 || out->size - out->len < len) {
+		out = zmalloc(sizeof(MqttOutput));
+		out->size = len > MQTT_OUTPUT_CHUNK ? len : MQTT_OUTPUT_CHUNK;
+		out->buf = zmalloc(out->size);
+		out->len = 0;
+		out->pos = 0;
+		out->fd = -1;
+		out->offset = 0;
+		out->remaining = 0;
+		out->callback = NULL;
+		out->privdata = NULL;
+		out->next = NULL;
+		if(mqtt->output_tail) {
+			mqtt->output_tail->next = out;
+		} else {
+			mqtt->output = out;
+		}
+		mqtt->output_tail = out;
+	}
+	ptr = out->buf + out->len;
+	out->len += len;
+	MQTT_STAT_ADD(mqtt->output_bytes, len);
+	return ptr;
+}
 
-	len += 2+strlen(msg->topic);
+/*
+ * Count a packet of len bytes, header included, queued for write.
+ */
+static void
+_mqtt_count_out(Mqtt *mqtt, uint8_t header, size_t len) {
+	MQTT_STAT_ADD(mqtt->stats.packets_out[header >> 4], 1);
+	MQTT_STAT_ADD(mqtt->stats.bytes_out[header >> 4], len);
+	MQTT_TRACE(mqtt->trace, MQTT_TRACE_ENCODE, header >> 4, 0, len);
+}
 
-	if(msg->qos > MQTT_QOS0) len += 2; //msgid
+/*
+ * Queue a file range, sent with sendfile when the platform has it.
+ */
+static void
+_mqtt_output_file(Mqtt *mqtt, int fd, off_t offset, size_t len, MqttFileCallback callback, void *privdata) {
+	MqttOutput *out = zmalloc(sizeof(MqttOutput));
+	out->buf = NULL;
+	out->size = 0;
+	out->len = 0;
+	out->pos = 0;
+	out->fd = fd;
+	out->offset = offset;
+	out->remaining = len;
+	out->callback = callback;
+	out->privdata = privdata;
+	out->next = NULL;
+	if(mqtt->output_tail) {
+		mqtt->output_tail->next = out;
+	} else {
+		mqtt->output = out;
+	}
+	mqtt->output_tail = out;
+	MQTT_STAT_ADD(mqtt->output_bytes, len);
+}
+
+/*
+ * Unlink the head of the queue. The last memory chunk is kept for reuse.
+ */
+static void
+_mqtt_output_pop(Mqtt *mqtt, int status) {
+	MqttOutput *out = mqtt->output;
+	if(out->fd >= 0) {
+		MQTT_STAT_SUB(mqtt->output_bytes, out->remaining);
+		if(out->callback) out->callback(mqtt, out->fd, status, out->privdata);
+	} else {
+		MQTT_STAT_SUB(mqtt->output_bytes, out->len - out->pos);
+		if(out == mqtt->output_tail) {
+			out->len = out->pos = 0;
+			return;
+		}
+	}
+	mqtt->output = out->next;
+	if(!mqtt->output) mqtt->output_tail = NULL;
+	if(out->buf) zfree(out->buf);
+	zfree(out);
+}
+
+/*
+ * Drop everything queued, file callbacks are told the publish failed.
+ */
+static void
+_mqtt_output_clear(Mqtt *mqtt) {
+	MqttOutput *out, *next;
+	for(out = mqtt->output; out; out = next) {
+		next = out->next;
+		if(out->fd >= 0 && out->callback) {
+			out->callback(mqtt, out->fd, MQTT_ERR, out->privdata);
+		}
+		if(out->buf) zfree(out->buf);
+		zfree(out);
+	}
+	mqtt->output = mqtt->output_tail = NULL;
+	MQTT_STAT_SET(mqtt->output_bytes, 0);
+}
+
+/*
+ * Send a file range, returns bytes written or -1. Without sendfile, or
+ * when TLS is done in user space, it goes through a stack buffer.
+ */
+static ssize_t
+_mqtt_output_sendfile(Mqtt *mqtt, MqttOutput *out) {
+	ssize_t nread, nwritten;
+	size_t count = out->remaining;
+	char buffer[MQTT_BUFFER_SIZE];
+	struct iovec iov;
+#ifdef HAVE_SENDFILE
+	if(_mqtt_sock_plain(mqtt)) {
+		if(count > MQTT_SENDFILE_CHUNK) count = MQTT_SENDFILE_CHUNK;
+		nwritten = sendfile(mqtt->fd, out->fd, &out->offset, count);
+		if(nwritten == 0) {
+			errno = EIO; //file shorter than promised
+			return -1;
+		}
+		return nwritten;
+	}
+#endif
+	if(count > sizeof(buffer)) count = sizeof(buffer);
+	nread = pread(out->fd, buffer, count, out->offset);
+	if(nread <= 0) {
+		if(nread == 0) errno = EIO;
+		return -1;
+	}
+	iov.iov_base = buffer;
+	iov.iov_len = nread;
+	nwritten = _mqtt_sock_writev(mqtt, &iov, 1);
+	if(nwritten > 0) out->offset += nwritten;
+	return nwritten;
+}
+
+/*
+ * sendfile bytes never pass through us, read them back from the file so
+ * the capture holds the stream as written. Zeros stand in for what can
+ * no longer be read, the records stay framed.
+ */
+static void
+_mqtt_capture_file(Mqtt *mqtt, int fd, off_t offset, size_t len) {
+	char buffer[MQTT_BUFFER_SIZE];
+	struct iovec iov;
+	ssize_t nread;
+	size_t count;
+	while(len > 0) {
+		count = len < sizeof(buffer) ? len : sizeof(buffer);
+		nread = pread(fd, buffer, count, offset);
+		if(nread <= 0) {
+			memset(buffer, 0, count);
+			nread = count;
+		}
+		iov.iov_base = buffer;
+		iov.iov_len = nread;
+		mqtt_capture_append(mqtt->capture, MQTT_CAPTURE_WRITE, &iov, 1, nread);
+		offset += nread;
+		len -= nread;
+	}
+}
+
+/*
+ * After a write: on a hard error the queue is dropped and the socket
+ * shut down, so the reader sees it and reconnects. Whatever is left
+ * waits for the writable event.
+ */
+static int
+_mqtt_output_settle(Mqtt *mqtt, int err) {
+	int status = MQTT_OK;
+	if(err && err != EAGAIN && err != EINTR) {
+		mqtt->error = err;
+		_mqtt_set_error(mqtt->errstr, "socket error: %d.", err);
+		_mqtt_output_clear(mqtt);
+		shutdown(mqtt->fd, SHUT_RDWR);
+		status = MQTT_ERR;
+	}
+	if(mqtt->output_bytes > 0 && !mqtt->write_pending) {
+		aeCreateFileEvent(mqtt->el, mqtt->fd, AE_WRITABLE, _mqtt_write_ready, mqtt);
+		mqtt->write_pending = true;
+	} else if(mqtt->output_bytes == 0 && mqtt->write_pending) {
+		aeDeleteFileEvent(mqtt->el, mqtt->fd, AE_WRITABLE);
+		mqtt->write_pending = false;
+	}
+	return status;
+}
+
+/*
+ * Write out as much of the queue as the socket takes. Memory chunks go
+ * with one writev, file ranges with sendfile.
+ */
+static int
+_mqtt_flush(Mqtt *mqtt) {
+	int iovcnt, err = 0;
+	ssize_t nwritten;
+	MqttOutput *out;
+	struct iovec iov[MQTT_IOV_MAX];
+	bool cork;
+
+	if(mqtt->fd < 0) return MQTT_ERR;
+
+	//several writes ahead, let the kernel pack them into full frames
+	cork = mqtt->sockopts.cork && mqtt->output != mqtt->output_tail &&
+		!mqtt->unix_sock;
+	if(cork) anetTcpCork(NULL, mqtt->fd, 1);
+
+	while((out = mqtt->output) && mqtt->output_bytes > 0) {
+		if(out->fd >= 0) {
+			if(out->remaining == 0) {
+				_mqtt_output_pop(mqtt, MQTT_OK);
+				continue;
+			}
+			nwritten = _mqtt_output_sendfile(mqtt, out);
+			if(nwritten < 0) {
+				err = errno;
+				break;
+			}
+			MQTT_TRACE(mqtt->trace, MQTT_TRACE_WRITE, 0, 0, nwritten);
+			MQTT_STAT_ADD(mqtt->stats.bytes_written, nwritten);
+			if(mqtt->capture) {
+				_mqtt_capture_file(mqtt, out->fd, out->offset - nwritten, nwritten);
+			}
+			out->remaining -= nwritten;
+			MQTT_STAT_SUB(mqtt->output_bytes, nwritten);
+			continue;
+		}
+		for(iovcnt = 0; out && out->fd < 0 && iovcnt < MQTT_IOV_MAX; out = out->next) {
+			if(out->len == out->pos) continue;
+			iov[iovcnt].iov_base = out->buf + out->pos;
+			iov[iovcnt].iov_len = out->len - out->pos;
+			iovcnt++;
+		}
+		if(iovcnt == 0) {
+			_mqtt_output_pop(mqtt, MQTT_OK);
+			continue;
+		}
+		nwritten = _mqtt_sock_writev(mqtt, iov, iovcnt);
+		if(nwritten < 0) {
+			err = errno;
+			break;
+		}
+		MQTT_TRACE(mqtt->trace, MQTT_TRACE_WRITE, 0, 0, nwritten);
+		MQTT_STAT_ADD(mqtt->stats.bytes_written, nwritten);
+		if(mqtt->capture) {
+			mqtt_capture_append(mqtt->capture, MQTT_CAPTURE_WRITE, iov, iovcnt, nwritten);
+		}
+		while(nwritten > 0) {
+			out = mqtt->output;
+			if(nwritten < out->len - out->pos) {
+				out->pos += nwritten;
+				MQTT_STAT_SUB(mqtt->output_bytes, nwritten);
+				break;
+			}
+			nwritten -= out->len - out->pos;
+			_mqtt_output_pop(mqtt, MQTT_OK);
+		}
+	}
+
+	if(cork) anetTcpCork(NULL, mqtt->fd, 0);
+
+	//file ranges that were fully sent but not yet popped
+	while(mqtt->output && mqtt->output->fd >= 0 && mqtt->output->remaining == 0) {
+		_mqtt_output_pop(mqtt, MQTT_OK);
+	}
+
+	return _mqtt_output_settle(mqtt, err);
+}
+
+static void
+_mqtt_write_ready(aeEventLoop *el, int fd, void *privdata, int mask) {
+	MQTT_NOTUSED(el);
+	MQTT_NOTUSED(fd);
+	MQTT_NOTUSED(mask);
+	_mqtt_flush((Mqtt *)privdata);
+}
+
+/*
+ * Wait up to timeout ms for the queue to reach the socket, before the
+ * socket is closed.
+ */
+static void
+_mqtt_output_drain(Mqtt *mqtt, int timeout) {
+	struct pollfd pfd;
+	long long left, deadline = _mqtt_mstime() + timeout;
+	while(_mqtt_flush(mqtt) == MQTT_OK && mqtt->output_bytes > 0) {
+		left = deadline - _mqtt_mstime();
+		if(left <= 0) break;
+		pfd.fd = mqtt->fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		if(poll(&pfd, 1, left) < 0 && errno != EINTR) break;
+	}
+}
+
+/*
+ * Copy a small packet into the queue and flush.
+ */
+static int
+_mqtt_write(Mqtt *mqtt, const char *buffer, int len) {
+	memcpy(_mqtt_output_reserve(mqtt, len), buffer, len);
+	_mqtt_count_out(mqtt, (uint8_t)buffer[0], len);
+	return _mqtt_flush(mqtt);
+}
+
+static void 
+_mqtt_send_connect(Mqtt *mqtt) {
+	int len = 0;
+	char *ptr;
+	const char *clientid = mqtt->clientid ? mqtt->clientid : "";
+	bool v31 = (mqtt->protocol == MQTT_PROTO_V31);
+	bool v5 = (mqtt->protocol == MQTT_PROTO_V5);
+
+	uint8_t header = CONNECT;
+	uint8_t flags = 0;
+
+	int remaining_count = 0;
+	char remaining_length[4];
+
+	char props[16];
+	char *pptr = props;
+
+	//header, reserved bits must be zero since 3.1.1
+	if(v31) header = SETQOS(header, MQTT_QOS1);
+	
+	//flags
+	flags = FLAG_CLEANSESS(flags, mqtt->cleansess);
+	flags = FLAG_WILL(flags, (mqtt->will) ? 1 : 0);
+	if (mqtt->will) {
+		flags = FLAG_WILLQOS(flags, mqtt->will->qos);
+		flags = FLAG_WILLRETAIN(flags, mqtt->will->retain);
+	}
+	if (mqtt->username) flags = FLAG_USERNAME(flags, 1);
+	if (mqtt->password) flags = FLAG_PASSWD(flags, 1);
+
+	//properties
+	if(v5) {
+		if(mqtt->receive_max) {
+			_write_property_int(&pptr, PROP_RECEIVE_MAXIMUM, mqtt->receive_max);
+		}
+		if(mqtt->max_packet_size) {
+			_write_property_int32(&pptr, PROP_MAXIMUM_PACKET_SIZE, mqtt->max_packet_size);
+		}
+		if(mqtt->topic_alias_max) {
+			_write_property_int(&pptr, PROP_TOPIC_ALIAS_MAXIMUM, mqtt->topic_alias_max);
+		}
+	}
+
+	//length
+	len = 2 + (v31 ? strlen(PROTOCOL_MAGIC) : strlen(PROTOCOL_NAME)) + 1 + 1 + 2;
+	if(v5) {
+		len += _encode_remaining_length(remaining_length, pptr-props) + (pptr-props);
+	}
+	len += 2 + strlen(clientid);
+	if(mqtt->will) {
+		if(v5) len += 1; //will properties
+		len += 2 + strlen(mqtt->will->topic);
+		len += 2 + strlen(mqtt->will->msg);
+	}
+	if(mqtt->username) {
+		len += 2 + strlen(mqtt->username);
+	}
+	if(mqtt->password) {
+		len += 2 + strlen(mqtt->password);
+	}
+	
+	remaining_count = _encode_remaining_length(remaining_length, len);
+
+	ptr = _mqtt_output_reserve(mqtt, 1+remaining_count+len);
+	_mqtt_count_out(mqtt, header, 1+remaining_count+len);
+
+	_write_header(&ptr, header);
+	_write_remaining_length(&ptr, remaining_length, remaining_count);
+	_write_string(&ptr, v31 ? PROTOCOL_MAGIC : PROTOCOL_NAME);
+	_write_char(&ptr, mqtt->protocol);
+	_write_char(&ptr, flags);
+	_write_int(&ptr, mqtt->keepalive);
+	if(v5) _write_properties(&ptr, props, pptr-props);
+	_write_string(&ptr, clientid);
+
+	if(mqtt->will) {
+		if(v5) _write_char(&ptr, 0);
+		_write_string(&ptr, mqtt->will->topic);
+		_write_string(&ptr, mqtt->will->msg);
+	}
+	if (mqtt->username) {
+		_write_string(&ptr, mqtt->username);
+	}
+	if (mqtt->password) {
+		_write_string(&ptr, mqtt->password);
+	}
+}
+
+/*
+ * Replay the subscription registry right after CONNECT, without waiting
+ * for CONNACK. Filters are packed into as few SUBSCRIBE packets as fit
+ * MQTT_RESUB_PACKET_SIZE and queued behind CONNECT for a single write.
+ */
+static void
+_mqtt_resubscribe(Mqtt *mqtt) {
+	int len, n, msgid;
+	char *ptr;
+	MqttSub *sub, *next;
+
+	int remaining_count;
+	char remaining_length[4];
+
+	uint8_t header = SETQOS(SUBSCRIBE, MQTT_QOS1);
+
+	//pending unsubscribes are done, broker has forgotten them
+	for(sub = mqtt->subs; sub; sub = next) {
+		next = sub->next;
+		if(sub->unsubid) {
+			_mqtt_sub_remove(mqtt, sub);
+		}
+	}
+
+	sub = mqtt->subs;
+	while(sub) {
+		len = 2; //msgid
+		for(next = sub; next; next = next->next) {
+			n = 2 + strlen(next->topic) + 1; //topic and qos
+			if(len > 2 && len + n > MQTT_RESUB_PACKET_SIZE) break;
+			len += n;
+		}
+		if(mqtt->protocol == MQTT_PROTO_V5) len += 1; //properties
+		msgid = _mqtt_msgid(mqtt);
+		remaining_count = _encode_remaining_length(remaining_length, len);
+		ptr = _mqtt_output_reserve(mqtt, 1 + remaining_count + len);
+		_mqtt_count_out(mqtt, header, 1 + remaining_count + len);
+		_write_header(&ptr, header);
+		_write_remaining_length(&ptr, remaining_length, remaining_count);
+		_write_int(&ptr, msgid);
+		if(mqtt->protocol == MQTT_PROTO_V5) _write_char(&ptr, 0);
+		for(; sub != next; sub = sub->next) {
+			sub->msgid = msgid;
+			_write_string(&ptr, sub->topic);
+			_write_char(&ptr, sub->qos);
+			_mqtt_callback(mqtt, SUBSCRIBE, sub->topic, msgid);
+		}
+	}
+}
+
+static void _mqtt_read(aeEventLoop *el, int fd, void *privdata, int mask);
+
+/*
+ * Open the socket. A "unix:/path" server is a broker on this host and is
+ * reached through AF_UNIX, without TLS. Anything else goes over TCP.
+ */
+static int
+_mqtt_sock_open(Mqtt *mqtt) {
+	char server[1024] = {0};
+	char *path;
+	if(_mqtt_host_is_unix(mqtt->server)) {
+		path = mqtt->server + strlen(MQTT_UNIX_PREFIX);
+		if(strlen(path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+			_mqtt_set_error(mqtt->errstr, "unix socket path too long: %s", path);
+			return -1;
+		}
+		return anetUnixConnect(mqtt->errstr, path);
+	}
+	if(anetResolve(mqtt->errstr, mqtt->server, server) != ANET_OK) {
+		return -1;
+	}
+	return anetTcpConnect(mqtt->errstr, server, mqtt->port);
+}
+
+/*--------------------------------------
+** MQTT server list.
+--------------------------------------*/
+int
+mqtt_add_server(Mqtt *mqtt, const char *host, int port) {
+	MqttServer *server;
+	mqtt->servers = zrealloc(mqtt->servers, sizeof(MqttServer) * (mqtt->server_count + 1));
+	server = &mqtt->servers[mqtt->server_count++];
+	server->host = zstrdup(host);
+	server->port = port;
+	server->connect_ms = 0;
+	server->rtt_ms = 0;
+	server->connects = 0;
+	server->pings = 0;
+	server->failures = 0;
+	return mqtt->server_count;
+}
+
+void
+mqtt_clear_servers(Mqtt *mqtt) {
+	int i;
+	for(i = 0; i < mqtt->server_count; i++) {
+		zfree(mqtt->servers[i].host);
+	}
+	if(mqtt->servers) zfree(mqtt->servers);
+	mqtt->servers = NULL;
+	mqtt->server_count = 0;
+	mqtt->server_current = -1;
+	mqtt->server_round = 0;
+}
+
+const MqttServer *
+mqtt_get_servers(Mqtt *mqtt, int *count) {
+	*count = mqtt->server_count;
+	return mqtt->servers;
+}
+
+void
+mqtt_set_connect_race(Mqtt *mqtt, bool race) {
+	mqtt->connect_race = race;
+}
+
+static double
+_mqtt_ewma(double avg, int samples, double value) {
+	return samples ? avg + MQTT_EWMA_WEIGHT * (value - avg) : value;
+}
+
+/*
+ * Lower is better. Failures in a row come first, then the ping round
+ * trip, or the connect time before any ping. Unknown servers rank
+ * behind known good ones, ties keep the list order.
+ */
+static double
+_mqtt_server_score(MqttServer *server) {
+	double latency = MQTT_SERVER_UNKNOWN_MS;
+	if(server->pings) {
+		latency = server->rtt_ms;
+	} else if(server->connects) {
+		latency = server->connect_ms;
+	}
+	return server->failures * MQTT_SERVER_UNKNOWN_MS * 10 + latency;
+}
+
+static int
+_mqtt_server_pick(Mqtt *mqtt, const char *tried) {
+	int i, best = -1;
+	for(i = 0; i < mqtt->server_count; i++) {
+		if(tried[i]) continue;
+		if(best < 0 || _mqtt_server_score(&mqtt->servers[i]) <
+			_mqtt_server_score(&mqtt->servers[best])) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+static void
+_mqtt_server_use(Mqtt *mqtt, int index) {
+	mqtt->server_current = index;
+	if(mqtt->server) zfree(mqtt->server);
+	mqtt->server = zstrdup(mqtt->servers[index].host);
+	mqtt->port = mqtt->servers[index].port;
+}
+
+static void
+_mqtt_server_failed(Mqtt *mqtt, int index) {
+	if(index < 0) return;
+	mqtt->servers[index].failures++;
+	mqtt->server_round++;
+}
+
+static void
+_mqtt_server_connected(Mqtt *mqtt) {
+	MqttServer *server;
+	if(mqtt->server_current < 0) return;
+	server = &mqtt->servers[mqtt->server_current];
+	server->connect_ms = _mqtt_ewma(server->connect_ms, server->connects,
+		_mqtt_mstime() - mqtt->connect_start);
+	server->connects++;
+	server->failures = 0;
+	mqtt->server_round = 0;
+}
+
+static void
+_mqtt_server_pong(Mqtt *mqtt, uint64_t rtt) {
+	MqttServer *server;
+	if(mqtt->server_current < 0) return;
+	server = &mqtt->servers[mqtt->server_current];
+	server->rtt_ms = _mqtt_ewma(server->rtt_ms, server->pings, rtt / 1000.0);
+	server->pings++;
+}
+
+static int _mqtt_connect_fd(Mqtt *mqtt, int fd);
+static void _mqtt_reconnect_later(Mqtt *mqtt);
+
+//close the sockets still racing, the winner was taken out already
+static void
+_mqtt_race_stop(Mqtt *mqtt) {
+	int i;
+	for(i = 0; i < 2; i++) {
+		if(mqtt->race_fds[i] < 0) continue;
+		aeDeleteFileEvent(mqtt->el, mqtt->race_fds[i], AE_WRITABLE);
+		close(mqtt->race_fds[i]);
+		mqtt->race_fds[i] = -1;
+	}
+	if(mqtt->race_timer != -1) {
+		aeDeleteTimeEvent(mqtt->el, mqtt->race_timer);
+		mqtt->race_timer = -1;
+	}
+}
+
+/*
+ * A racing connect completed. The first to succeed wins, the other is
+ * closed. When both failed the next servers are tried shortly.
+ */
+static void
+_mqtt_race_ready(aeEventLoop *el, int fd, void *privdata, int mask) {
+	Mqtt *mqtt = (Mqtt *)privdata;
+	int i, err = 0;
+	socklen_t errlen = sizeof(err);
+	MQTT_NOTUSED(mask);
+	for(i = 0; i < 2 && mqtt->race_fds[i] != fd; i++);
+	if(i == 2) return;
+	aeDeleteFileEvent(el, fd, AE_WRITABLE);
+	mqtt->race_fds[i] = -1;
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) err = errno;
+	if(err) {
+		_mqtt_set_error(mqtt->errstr, "connect: %s", strerror(err));
+		_mqtt_server_failed(mqtt, mqtt->race_index[i]);
+		close(fd);
+		if(mqtt->race_fds[0] < 0 && mqtt->race_fds[1] < 0) {
+			_mqtt_race_stop(mqtt);
+			_mqtt_reconnect_later(mqtt);
+		}
+		return;
+	}
+	_mqtt_race_stop(mqtt);
+	_mqtt_server_use(mqtt, mqtt->race_index[i]);
+	anetBlock(mqtt->errstr, fd);
+	if(_mqtt_connect_fd(mqtt, fd) < 0) {
+		_mqtt_reconnect_later(mqtt);
+	} else {
+		mqtt->retries = 1;
+	}
+}
+
+//still pending at the deadline counts as failed
+static int
+_mqtt_race_timeout(aeEventLoop *el, long long id, void *clientdata) {
+	Mqtt *mqtt = (Mqtt *)clientdata;
+	int i;
+	MQTT_NOTUSED(el);
+	if(mqtt->race_timer != id) return AE_NOMORE;
+	mqtt->race_timer = -1;
+	_mqtt_set_error(mqtt->errstr, "connect timeout");
+	for(i = 0; i < 2; i++) {
+		if(mqtt->race_fds[i] >= 0) _mqtt_server_failed(mqtt, mqtt->race_index[i]);
+	}
+	_mqtt_race_stop(mqtt);
+	_mqtt_reconnect_later(mqtt);
+	return AE_NOMORE;
+}
+
+/*
+ * Non-blocking connects to two servers, finished on the event loop by
+ * _mqtt_race_ready. MQTT_ERR when neither could be started.
+ */
+static int
+_mqtt_race_start(Mqtt *mqtt, int first, int second) {
+	int i, fd, started = 0;
+	char ip[1024];
+	mqtt->race_index[0] = first;
+	mqtt->race_index[1] = second;
+	for(i = 0; i < 2; i++) {
+		fd = -1;
+		if(anetResolve(mqtt->errstr, mqtt->servers[mqtt->race_index[i]].host, ip) == ANET_OK) {
+			fd = anetTcpNonBlockConnect(mqtt->errstr, ip, mqtt->servers[mqtt->race_index[i]].port);
+		}
+		if(fd < 0) {
+			_mqtt_server_failed(mqtt, mqtt->race_index[i]);
+			continue;
+		}
+		if(aeCreateFileEvent(mqtt->el, fd, AE_WRITABLE, _mqtt_race_ready, mqtt) == AE_ERR) {
+			_mqtt_set_error(mqtt->errstr, "connect: no room in the event loop");
+			_mqtt_server_failed(mqtt, mqtt->race_index[i]);
+			close(fd);
+			continue;
+		}
+		mqtt->race_fds[i] = fd;
+		started++;
+	}
+	if(!started) return MQTT_ERR;
+	mqtt->race_timer = aeCreateTimeEvent(mqtt->el, MQTT_RACE_TIMEOUT, _mqtt_race_timeout, mqtt, NULL);
+	return MQTT_OK;
+}
+
+/*
+ * Connect to the configured server, or walk the list from the
+ * healthiest server down until one accepts. Returns 0 when a race was
+ * started, the loop finishes it.
+ */
+static int
+_mqtt_sock_connect(Mqtt *mqtt) {
+	int fd = -1, first, second;
+	char *tried;
+
+	if(mqtt->server_count == 0) return _mqtt_sock_open(mqtt);
+	tried = zmalloc(mqtt->server_count);
+	memset(tried, 0, mqtt->server_count);
+	while(fd < 0 && (first = _mqtt_server_pick(mqtt, tried)) >= 0) {
+		tried[first] = 1;
+		second = mqtt->connect_race ? _mqtt_server_pick(mqtt, tried) : -1;
+		if(second >= 0 && !_mqtt_host_is_unix(mqtt->servers[first].host) &&
+			!_mqtt_host_is_unix(mqtt->servers[second].host)) {
+			tried[second] = 1;
+			if(_mqtt_race_start(mqtt, first, second) == MQTT_OK) fd = 0;
+			continue;
+		}
+		_mqtt_server_use(mqtt, first);
+		fd = _mqtt_sock_open(mqtt);
+		if(fd < 0) _mqtt_server_failed(mqtt, first);
+	}
+	zfree(tried);
+	return fd;
+}
+
+/*
+ * Apply the socket options. This is best effort: a failure is left in
+ * errstr and the connection goes on with the kernel default.
+ */
+static void
+_mqtt_sock_setup(Mqtt *mqtt, int fd) {
+	MqttSockOpts *opts = &mqtt->sockopts;
+	if(opts->sndbuf) anetSetSendBuffer(mqtt->errstr, fd, opts->sndbuf);
+	if(opts->rcvbuf) anetSetRecvBuffer(mqtt->errstr, fd, opts->rcvbuf);
+	if(opts->busy_poll) anetBusyPoll(mqtt->errstr, fd, opts->busy_poll);
+	if(mqtt->unix_sock) return;
+	if(opts->nodelay) anetTcpNoDelay(mqtt->errstr, fd);
+	if(opts->keepalive) anetKeepAlive(mqtt->errstr, fd, opts->keepalive);
+	if(opts->quickack) anetTcpQuickAck(mqtt->errstr, fd);
+	if(opts->notsent_lowat) anetTcpNotSentLowat(mqtt->errstr, fd, opts->notsent_lowat);
+}
+
+static bool _mqtt_reading(Mqtt *mqtt);
+static void _mqtt_read_set(Mqtt *mqtt, bool paused, bool throttled);
+static void _mqtt_inbound_hold(Mqtt *mqtt);
+static void _mqtt_inbound_release(Mqtt *mqtt, const MqttMsg *msg);
+
+int 
+mqtt_connect(Mqtt *mqtt) {
+    int fd;
+    if(mqtt->reconnect_timer != -1) {
+        aeDeleteTimeEvent(mqtt->el, mqtt->reconnect_timer);
+        mqtt->reconnect_timer = -1;
+    }
+    _mqtt_race_stop(mqtt);
+    mqtt->connect_start = _mqtt_mstime();
+    fd = _mqtt_sock_connect(mqtt);
+    if (fd <= 0) {
+        return fd;
+    }
+    return _mqtt_connect_fd(mqtt, fd);
+}
+
+/*
+ * The socket is connected: set it up and send CONNECT.
+ */
+static int
+_mqtt_connect_fd(Mqtt *mqtt, int fd) {
+    mqtt->unix_sock = _mqtt_host_is_unix(mqtt->server);
+    _mqtt_sock_setup(mqtt, fd);
+#ifdef MQTT_TLS
+    if(mqtt->tls && !mqtt->unix_sock && mqtt_tls_connect(mqtt->tls, mqtt->errstr, fd, mqtt->server) != MQTT_OK) {
+        _mqtt_server_failed(mqtt, mqtt->server_current);
+        close(fd);
+        return -1;
+    }
+#endif
+    anetNonBlock(mqtt->errstr, fd);
+    mqtt->fd = fd;
+    mqtt->rlen = 0;
+    _mqtt_output_clear(mqtt);
+    mqtt->server_receive_max = MQTT_RECEIVE_MAX;
+    mqtt->server_max_packet_size = 0;
+    mqtt->ping_sent = 0;
+    //acks owed on the old connection are void, the broker redelivers
+    mqtt->epoch++;
+    MQTT_STAT_SET(mqtt->inbound_pending, 0);
+    mqtt->inbound_held = 0;
+    mqtt->read_throttled = false;
+    if(mqtt->dispatch) mqtt_dispatch_reset(mqtt->dispatch);
+    if(mqtt->cleansess) _mqtt_inflight_clear(mqtt);
+    _mqtt_alias_reset(mqtt, 0);
+    if(_mqtt_reading(mqtt)) {
+        aeCreateFileEvent(mqtt->el, fd, AE_READABLE, (aeFileProc *)_mqtt_read, (void *)mqtt); 
+    }
+	_mqtt_send_connect(mqtt);
+	if(mqtt->cleansess) _mqtt_resubscribe(mqtt);
+	_mqtt_flush(mqtt);
+    mqtt_set_state(mqtt, MQTT_STATE_CONNECTING);
+	_mqtt_callback(mqtt, CONNECT, NULL, MQTT_STATE_CONNECTING);
+
+    return fd;
+}
+
+/*
+ * With a server list the others are tried right away. Back off only
+ * once every server failed, returns -1 then.
+ */
+static int
+_mqtt_failover_delay(Mqtt *mqtt) {
+	if(mqtt->server_round < mqtt->server_count) {
+		return MQTT_FAILOVER_DELAY + random() % MQTT_FAILOVER_DELAY;
+	}
+	mqtt->server_round = 0;
+	return -1;
+}
+
+static int 
+_mqtt_reconnect(aeEventLoop *el, long long id, void *clientData)
+{
+    int fd;
+    Mqtt *mqtt = (Mqtt*)clientData;
+    MQTT_NOTUSED(el);
+    if(mqtt->reconnect_timer != id) return AE_NOMORE;
+    mqtt->reconnect_timer = -1;
+    MQTT_STAT_ADD(mqtt->stats.reconnects, 1);
+    fd = mqtt_connect((Mqtt *)clientData);
+    if(fd < 0) {
+        _mqtt_reconnect_later(mqtt);
+    } else if(fd > 0) {
+        mqtt->retries = 1;
+    }
+    return AE_NOMORE;
+}
+
+/*
+ * The next server soon while some in the list are left to try, then
+ * back off.
+ */
+static void
+_mqtt_reconnect_later(Mqtt *mqtt) {
+    int timeout = _mqtt_failover_delay(mqtt);
+    if(timeout < 0) {
+        if(mqtt->retries > MAX_RETRIES) {
+            mqtt->retries = 1;
+        } 
+        timeout = ((2 * mqtt->retries) * 60) * 1000;
+        mqtt->retries++;
+    }
+    if(mqtt->reconnect_timer != -1) aeDeleteTimeEvent(mqtt->el, mqtt->reconnect_timer);
+    mqtt->reconnect_timer = aeCreateTimeEvent(mqtt->el, timeout, _mqtt_reconnect, mqtt, NULL);
+}
+
+static void _mqtt_close(Mqtt *mqtt, bool drain);
+
+/*
+ * Drop a broken connection and try again later. Nothing more is
+ * written to it, what is queued is dropped.
+ */
+static void
+_mqtt_drop(Mqtt *mqtt) {
+	int timeout;
+	_mqtt_close(mqtt, false);
+	timeout = _mqtt_failover_delay(mqtt);
+	if(timeout < 0) timeout = (random() % 300) * 1000;
+	if(mqtt->reconnect_timer != -1) aeDeleteTimeEvent(mqtt->el, mqtt->reconnect_timer);
+	mqtt->reconnect_timer = aeCreateTimeEvent(mqtt->el, timeout, _mqtt_reconnect, mqtt, NULL);
+}
+
+/*
+ * Encode a PUBLISH up to its payload into the output queue, with room
+ * for the payload too when with_payload is set. Returns where the
+ * payload goes, NULL when the broker would refuse the packet.
+ */
+static char *
+_mqtt_publish_header(Mqtt *mqtt, uint8_t header, const char *topic, int topiclen, int msgid, int payloadlen, bool with_payload) {
+	int len = 0;
+	char *ptr;
+	char remaining_length[4];
+	int remaining_count;
+	int alias = 0;
+	bool known = false;
+
+	if(mqtt->alias_count > 0) {
+		alias = _mqtt_alias_out(mqtt, topic, topiclen, &known);
+	}
+
+	len += 2 + (known ? 0 : topiclen);
+
+	if(GETQOS(header) > MQTT_QOS0) len += 2; //msgid
+
+	if(mqtt->protocol == MQTT_PROTO_V5) len += alias ? 4 : 1; //properties
+
+	len += payloadlen;
+	
+	remaining_count = _encode_remaining_length(remaining_length, len);
+
+	if(mqtt->server_max_packet_size &&
+		1 + remaining_count + len > mqtt->server_max_packet_size) {
+		_mqtt_set_error(mqtt->errstr, "packet too large: %d > %d",
+			1 + remaining_count + len, mqtt->server_max_packet_size);
+		if(alias && !known) { //never sent, the broker must not rely on it
+			zfree(mqtt->aliases[alias-1].topic);
+			mqtt->aliases[alias-1].topic = NULL;
+			mqtt->aliases[alias-1].used = 0;
+		}
+		return NULL;
+	}
+	
+	ptr = _mqtt_output_reserve(mqtt, 1 + remaining_count + len -
+		(with_payload ? 0 : payloadlen));
+	_mqtt_count_out(mqtt, header, 1 + remaining_count + len);
+
+	_write_header(&ptr, header);
+	_write_remaining_length(&ptr, remaining_length, remaining_count);
+	_write_string_len(&ptr, topic, known ? 0 : topiclen);
+	if(GETQOS(header) > MQTT_QOS0) {
+		_write_int(&ptr, msgid);
+	}
+	if(alias) {
+		_write_char(&ptr, 3);
+		_write_property_int(&ptr, PROP_TOPIC_ALIAS, alias);
+	} else if(mqtt->protocol == MQTT_PROTO_V5) {
+		_write_char(&ptr, 0);
+	}
+	return ptr;
+}
+
+static int 
+_mqtt_send_publish(Mqtt *mqtt, MqttMsg *msg) {
+	char *ptr;
+	int payloadlen = msg->payload ? msg->payloadlen : 0;
+
+	uint8_t header = PUBLISH;
+	header = SETRETAIN(header, msg->retain);
+	header = SETQOS(header, msg->qos);
+	header = SETDUP(header, msg->dup);
+
+	ptr = _mqtt_publish_header(mqtt, header, msg->topic, strlen(msg->topic),
+		msg->id, payloadlen, true);
+	if(!ptr) return MQTT_ERR;
+	if(payloadlen) {
+		_write_payload(&ptr, msg->payload, payloadlen);
+	}
+	return _mqtt_flush(mqtt);
+}
+
+/*
+ * Check the broker's in-flight window and pick a msgid for a publish,
+ * msgid is kept when the caller set one.
+ */
+static int
+_mqtt_publish_id(Mqtt *mqtt, uint8_t qos, int msgid) {
+	if(qos > MQTT_QOS0 && !_mqtt_inflight_find(mqtt, msgid) &&
+		mqtt->inflight_count >= mqtt->server_receive_max) {
+		_mqtt_set_error(mqtt->errstr, "inflight window full: %d", mqtt->inflight_count);
+		return MQTT_ERR;
+	}
+	if(msgid == 0) {
+		do {
+			msgid = _mqtt_msgid(mqtt);
+		} while(_mqtt_inflight_find(mqtt, msgid));
+	}
+	return msgid;
+}
+
+static void
+_mqtt_publish_sent(Mqtt *mqtt, MqttMsg *msg, MqttPublishCallback callback, void *ctx) {
+	MqttInflight *slot = NULL;
+	if(msg->qos > MQTT_QOS0) {
+		slot = _mqtt_inflight_find(mqtt, msg->id);
+		if(!slot) slot = _mqtt_inflight_add(mqtt, msg->id, msg->qos);
+		slot->sent = mqtt_hist_now();
+		if(callback) {
+			slot->callback = callback;
+			slot->ctx = ctx;
+		}
+	}
+	_mqtt_callback(mqtt, PUBLISH, msg, msg->id);
+	if(!slot && callback) callback(mqtt, msg->id, MQTT_OK, ctx);
+}
+
+//PUBLISH
+int 
+mqtt_publish(Mqtt *mqtt, MqttMsg *msg) {
+	int msgid = _mqtt_publish_id(mqtt, msg->qos, msg->id);
+	if(msgid < 0) return MQTT_ERR;
+	msg->id = msgid;
+	if(_mqtt_send_publish(mqtt, msg) != MQTT_OK) {
+		return MQTT_ERR;
+	}
+	_mqtt_publish_sent(mqtt, msg, NULL, NULL);
+	return msg->id;
+}
+
+/*
+ * PUBLISH a payload made of parts, without staging it. When nothing is
+ * queued the header and parts go out with one writev and only what the
+ * socket did not take is copied into the queue.
+ */
+int
+mqtt_publish_iov(Mqtt *mqtt, const char *topic, uint8_t qos, const struct iovec *parts, int n) {
+	int i, msgid, err = 0;
+	bool direct;
+	char *ptr;
+	size_t len, payloadlen = 0;
+	ssize_t nwritten;
+	MqttOutput *out;
+	struct iovec iov[MQTT_IOV_MAX];
+	MqttMsg msg = {0, qos, false, false, topic, 0, NULL, 0};
+
+	for(i = 0; i < n; i++) payloadlen += parts[i].iov_len;
+	if(payloadlen > MAX_PAYLOAD_SIZE) {
+		_mqtt_set_error(mqtt->errstr, "payload too large: %zu", payloadlen);
+		return MQTT_ERR;
+	}
+	msg.payloadlen = payloadlen;
+	msgid = _mqtt_publish_id(mqtt, qos, 0);
+	if(msgid < 0) return MQTT_ERR;
+	msg.id = msgid;
+
+	direct = mqtt->fd >= 0 && mqtt->output_bytes == 0 && n < MQTT_IOV_MAX;
+	ptr = _mqtt_publish_header(mqtt, SETQOS(PUBLISH, qos), topic, strlen(topic),
+		msgid, payloadlen, !direct);
+	if(!ptr) return MQTT_ERR;
+
+	if(!direct) {
+		for(i = 0; i < n; i++) {
+			_write_payload(&ptr, parts[i].iov_base, parts[i].iov_len);
+		}
+		if(_mqtt_flush(mqtt) != MQTT_OK) return MQTT_ERR;
+	} else {
+		//the header is all there is in the queue
+		out = mqtt->output_tail;
+		iov[0].iov_base = out->buf + out->pos;
+		iov[0].iov_len = out->len - out->pos;
+		memcpy(iov + 1, parts, sizeof(struct iovec) * n);
+		nwritten = _mqtt_sock_writev(mqtt, iov, n + 1);
+		if(nwritten < 0) {
+			err = errno;
+			nwritten = 0;
+		}
+		if(nwritten > 0) {
+			MQTT_TRACE(mqtt->trace, MQTT_TRACE_WRITE, 0, 0, nwritten);
+			MQTT_STAT_ADD(mqtt->stats.bytes_written, nwritten);
+			if(mqtt->capture) {
+				mqtt_capture_append(mqtt->capture, MQTT_CAPTURE_WRITE, iov, n + 1, nwritten);
+			}
+		}
+		len = (size_t)nwritten < iov[0].iov_len ? (size_t)nwritten : iov[0].iov_len;
+		out->pos += len;
+		MQTT_STAT_SUB(mqtt->output_bytes, len);
+		nwritten -= len;
+		if(out->pos == out->len) _mqtt_output_pop(mqtt, MQTT_OK);
+		for(i = 0; i < n; i++) {
+			len = parts[i].iov_len;
+			if((size_t)nwritten >= len) {
+				nwritten -= len;
+				continue;
+			}
+			memcpy(_mqtt_output_reserve(mqtt, len - nwritten),
+				(char *)parts[i].iov_base + nwritten, len - nwritten);
+			nwritten = 0;
+		}
+		if(_mqtt_output_settle(mqtt, err) != MQTT_OK) return MQTT_ERR;
+	}
+	_mqtt_publish_sent(mqtt, &msg, NULL, NULL);
+	return msgid;
+}
+
+/*
+ * PUBLISH from borrowed buffers: nothing is allocated or strlen'd, topic
+ * and payload are copied once, into the output queue. The PUBLISH
+ * callback gets topic as passed, NUL-terminated only if it was.
+ */
+int
+mqtt_publish_raw(Mqtt *mqtt, const char *topic, int topiclen, const char *payload, int payloadlen, uint8_t qos, bool retain) {
+	char *ptr;
+	MqttMsg msg = {0, qos, retain, false, topic, payloadlen, payload, 0};
+	int msgid = _mqtt_publish_id(mqtt, qos, 0);
+	if(msgid < 0) return MQTT_ERR;
+	msg.id = msgid;
+	ptr = _mqtt_publish_header(mqtt, SETQOS(SETRETAIN(PUBLISH, retain), qos),
+		topic, topiclen, msgid, payloadlen, true);
+	if(!ptr) return MQTT_ERR;
+	_write_payload(&ptr, payload, payloadlen);
+	if(_mqtt_flush(mqtt) != MQTT_OK) return MQTT_ERR;
+	_mqtt_publish_sent(mqtt, &msg, NULL, NULL);
+	return msgid;
+}
+
+/*
+ * PUBLISH and keep callback and ctx in the in-flight slot, so the caller
+ * needs no msgid map of its own. callback is not called when this
+ * returns MQTT_ERR.
+ */
+int
+mqtt_publish_ex(Mqtt *mqtt, MqttMsg *msg, MqttPublishCallback callback, void *ctx) {
+	int msgid;
+	MqttInflight *slot = _mqtt_inflight_find(mqtt, msg->id);
+	if(slot && slot->callback) {
+		_mqtt_set_error(mqtt->errstr, "msgid %d is in flight", msg->id);
+		return MQTT_ERR;
+	}
+	msgid = _mqtt_publish_id(mqtt, msg->qos, msg->id);
+	if(msgid < 0) return MQTT_ERR;
+	msg->id = msgid;
+	if(_mqtt_send_publish(mqtt, msg) != MQTT_OK) {
+		return MQTT_ERR;
+	}
+	_mqtt_publish_sent(mqtt, msg, callback, ctx);
+	return msg->id;
+}
+
+/*
+ * PUBLISH len bytes of fd from offset. The header goes through the output
+ * queue and the payload is sent from the page cache with sendfile, so it
+ * is never copied to user space. callback is called once the last byte
+ * is written or the connection is lost, fd must stay open until then.
+ */
+int
+mqtt_publish_fd(Mqtt *mqtt, const char *topic, uint8_t qos, int fd, off_t offset, size_t len, MqttFileCallback callback, void *privdata) {
+	int msgid;
+	uint8_t header = SETQOS(PUBLISH, qos);
+	MqttMsg msg = {0, qos, false, false, topic, len, NULL, 0};
+
+	if(mqtt->fd < 0) {
+		_mqtt_set_error(mqtt->errstr, "not connected");
+		return MQTT_ERR;
+	}
+	if(len > MAX_PAYLOAD_SIZE) {
+		_mqtt_set_error(mqtt->errstr, "payload too large: %zu", len);
+		return MQTT_ERR;
+	}
+	msgid = _mqtt_publish_id(mqtt, qos, 0);
+	if(msgid < 0) return MQTT_ERR;
+	msg.id = msgid;
+	if(!_mqtt_publish_header(mqtt, header, topic, strlen(topic), msgid, len, false)) {
+		return MQTT_ERR;
+	}
+	_mqtt_output_file(mqtt, fd, offset, len, callback, privdata);
+	if(_mqtt_flush(mqtt) != MQTT_OK) return MQTT_ERR;
+	_mqtt_publish_sent(mqtt, &msg, NULL, NULL);
+	return msgid;
+}
+
+/*
+ * Encode the header flags and the length-prefixed topic once, so that
+ * publishing to the topic only patches remaining length and msgid.
+ */
+MqttTopicHandle *
+mqtt_topic_prepare(Mqtt *mqtt, const char *topic, uint8_t qos, bool retain) {
+	char *ptr;
+	int topiclen = strlen(topic);
+	MqttTopicHandle *handle = zmalloc(sizeof(MqttTopicHandle));
+	handle->mqtt = mqtt;
+	handle->qos = qos;
+	handle->retain = retain;
+	handle->header = SETQOS(SETRETAIN(PUBLISH, retain), qos);
+	handle->encodedlen = 2 + topiclen;
+	ptr = handle->encoded = zmalloc(handle->encodedlen + 1);
+	_write_string_len(&ptr, topic, topiclen);
+	*ptr = '\0';
+	handle->topic = handle->encoded + 2;
+	return handle;
+}
+
+int
+mqtt_publish_prepared(MqttTopicHandle *handle, const char *payload, int payloadlen) {
+	int len, msgid;
+	char *ptr;
+	char remaining_length[4];
+	int remaining_count;
+	Mqtt *mqtt = handle->mqtt;
+	MqttMsg msg = {0, handle->qos, handle->retain, false,
+		handle->topic, payloadlen, payload, 0};
+
+	//aliases are assigned per publish, take the generic path
+	if(mqtt->alias_count > 0) return mqtt_publish(mqtt, &msg);
+
+	msgid = _mqtt_publish_id(mqtt, handle->qos, 0);
+	if(msgid < 0) return MQTT_ERR;
+	msg.id = msgid;
+
+	len = handle->encodedlen + payloadlen;
+	if(handle->qos > MQTT_QOS0) len += 2; //msgid
+	if(mqtt->protocol == MQTT_PROTO_V5) len += 1; //properties
+
+	remaining_count = _encode_remaining_length(remaining_length, len);
+
+	if(mqtt->server_max_packet_size &&
+		1 + remaining_count + len > mqtt->server_max_packet_size) {
+		_mqtt_set_error(mqtt->errstr, "packet too large: %d > %d",
+			1 + remaining_count + len, mqtt->server_max_packet_size);
+		return MQTT_ERR;
+	}
 
-	if(msg->payload) len += msg->payloadlen;
-	
-	remaining_count = _encode_remaining_length(remaining_length, len);
-	
-	ptr = buffer = zmalloc(1 + remaining_count + len);
+	ptr = _mqtt_output_reserve(mqtt, 1 + remaining_count + len);
+	_mqtt_count_out(mqtt, handle->header, 1 + remaining_count + len);
 
-	_write_header(&ptr, header);
+	_write_header(&ptr, handle->header);
 	_write_remaining_length(&ptr, remaining_length, remaining_count);
-	_write_string(&ptr, msg->topic);
-	if(msg->qos > MQTT_QOS0) {
-		_write_int(&ptr, msg->id);
+	_write_payload(&ptr, handle->encoded, handle->encodedlen);
+	if(handle->qos > MQTT_QOS0) {
+		_write_int(&ptr, msgid);
 	}
-	if(msg->payload) {
-		_write_payload(&ptr, msg->payload, msg->payloadlen);
+	if(mqtt->protocol == MQTT_PROTO_V5) {
+		_write_char(&ptr, 0);
 	}
-	anetWrite(mqtt->fd, buffer, ptr-buffer);
+	_write_payload(&ptr, payload, payloadlen);
+
+	if(_mqtt_flush(mqtt) != MQTT_OK) return MQTT_ERR;
 
-	zfree(buffer);
+	_mqtt_publish_sent(mqtt, &msg, NULL, NULL);
+	return msgid;
 }
 
-//PUBLISH
-int 
-mqtt_publish(Mqtt *mqtt, MqttMsg *msg) {
-	if(msg->id == 0) {
-		msg->id = mqtt->msgid++;
-	}
-	_mqtt_send_publish(mqtt, msg);
-	_mqtt_callback(mqtt, PUBLISH, msg, msg->id);
-	return msg->id;
+void
+mqtt_topic_release(MqttTopicHandle *handle) {
+	zfree(handle->encoded);
+	zfree(handle);
 }
 
 static void 
 _mqtt_send_ack(Mqtt *mqtt, int type, int msgid) {
 	char buffer[4] = {type, 2, MSB(msgid), LSB(msgid)};
-	anetWrite(mqtt->fd, buffer, 4);
+	_mqtt_write(mqtt, buffer, 4);
+}
+
+/*
+ * Queue an ack without flushing. The reader flushes once after the
+ * whole read; anything queued elsewhere goes on the writable event.
+ */
+static void
+_mqtt_queue_ack(Mqtt *mqtt, int type, int msgid) {
+	char *ptr;
+	if(mqtt->fd < 0) return;
+	ptr = _mqtt_output_reserve(mqtt, 4);
+	_mqtt_count_out(mqtt, type, 4);
+	ptr[0] = type;
+	ptr[1] = 2;
+	ptr[2] = MSB(msgid);
+	ptr[3] = LSB(msgid);
+	_mqtt_output_settle(mqtt, 0);
+}
+
+static void
+_mqtt_publish_ack(Mqtt *mqtt, const MqttMsg *msg) {
+	if(msg->qos == MQTT_QOS1) {
+		_mqtt_queue_ack(mqtt, PUBACK, msg->id);
+	} else if(msg->qos == MQTT_QOS2) {
+		_mqtt_queue_ack(mqtt, PUBREC, msg->id);
+	}
 }
 
 //PUBACK for QOS_1, QOS_2
@@ -365,7 +2090,7 @@ mqtt_pubrec(Mqtt *mqtt, int msgid) {
 //PUBREL for QOS_2
 void 
 mqtt_pubrel(Mqtt *mqtt, int msgid) {
-	_mqtt_send_ack(mqtt, PUBREL, msgid);
+	_mqtt_send_ack(mqtt, SETQOS(PUBREL, MQTT_QOS1), msgid);
 }
 
 //PUBCOMP for QOS_2
@@ -374,11 +2099,22 @@ mqtt_pubcomp(Mqtt *mqtt, int msgid) {
 	_mqtt_send_ack(mqtt, PUBCOMP, msgid);
 }
 
+//PUBACK or PUBREC for a message delivered in manual ack mode
+void
+mqtt_ack(Mqtt *mqtt, const MqttMsg *msg) {
+	//its msgid means nothing on this connection
+	if(msg->epoch && msg->epoch != mqtt->epoch) return;
+	_mqtt_publish_ack(mqtt, msg);
+	if(msg->qos == MQTT_QOS0 || mqtt->inbound_pending == 0) return;
+	MQTT_STAT_SUB(mqtt->inbound_pending, 1);
+	_mqtt_inbound_release(mqtt, msg);
+}
+
 static void
 _mqtt_send_subscribe(Mqtt *mqtt, int msgid, const char *topic, uint8_t qos) {
 
 	int len = 0;
-	char *ptr, *buffer;
+	char *ptr;
 
 	int remaining_count;
 	char remaining_length[4];
@@ -386,26 +2122,28 @@ _mqtt_send_subscribe(Mqtt *mqtt, int msgid, const char *topic, uint8_t qos) {
 	uint8_t header = SETQOS(SUBSCRIBE, MQTT_QOS1);
 
 	len += 2; //msgid
+	if(mqtt->protocol == MQTT_PROTO_V5) len += 1; //properties
 	len += 2 + strlen(topic) + 1; //topic and qos
 
 	remaining_count = _encode_remaining_length(remaining_length, len);
-	ptr = buffer = zmalloc(1 + remaining_count + len);
-	
+	ptr = _mqtt_output_reserve(mqtt, 1 + remaining_count + len);
+	_mqtt_count_out(mqtt, header, 1 + remaining_count + len);
+
 	_write_header(&ptr, header);
 	_write_remaining_length(&ptr, remaining_length, remaining_count);
 	_write_int(&ptr, msgid);
+	if(mqtt->protocol == MQTT_PROTO_V5) _write_char(&ptr, 0);
 	_write_string(&ptr, topic);
 	_write_char(&ptr, qos);
 
-	anetWrite(mqtt->fd, buffer, ptr-buffer);
-
-	zfree(buffer);
+	_mqtt_flush(mqtt);
 }
 
 //SUBSCRIBE
 int
 mqtt_subscribe(Mqtt *mqtt, const char *topic, unsigned char qos) {
-	int msgid = mqtt->msgid++;
+	int msgid = _mqtt_msgid(mqtt);
+	_mqtt_sub_add(mqtt, topic, qos)->msgid = msgid;
 	_mqtt_send_subscribe(mqtt, msgid, topic, qos);
 	_mqtt_callback(mqtt, SUBSCRIBE, (void *)topic, msgid);
 	return msgid;
@@ -414,7 +2152,7 @@ mqtt_subscribe(Mqtt *mqtt, const char *topic, unsigned char qos) {
 static void 
 _mqtt_send_unsubscribe(Mqtt *mqtt, int msgid, const char *topic) {
 	int len = 0;
-	char *ptr, *buffer;
+	char *ptr;
 	
 	int remaining_count;
 	char remaining_length[4];
@@ -422,25 +2160,28 @@ _mqtt_send_unsubscribe(Mqtt *mqtt, int msgid, const char *topic) {
 	uint8_t header = SETQOS(UNSUBSCRIBE, MQTT_QOS1);
 	
 	len += 2; //msgid
+	if(mqtt->protocol == MQTT_PROTO_V5) len += 1; //properties
 	len += 2+strlen(topic); //topic
 
 	remaining_count = _encode_remaining_length(remaining_length, len);
-	ptr = buffer = zmalloc(1 + remaining_count + len);
-	
+	ptr = _mqtt_output_reserve(mqtt, 1 + remaining_count + len);
+	_mqtt_count_out(mqtt, header, 1 + remaining_count + len);
+
 	_write_header(&ptr, header);
 	_write_remaining_length(&ptr, remaining_length, remaining_count);
 	_write_int(&ptr, msgid);
+	if(mqtt->protocol == MQTT_PROTO_V5) _write_char(&ptr, 0);
 	_write_string(&ptr, topic);
 
-	anetWrite(mqtt->fd, buffer, ptr-buffer);
-
-	zfree(buffer);
+	_mqtt_flush(mqtt);
 }
 
 //UNSUBSCRIBE
 int
 mqtt_unsubscribe(Mqtt *mqtt, const char *topic) {
-	int msgid = mqtt->msgid++;
+	int msgid = _mqtt_msgid(mqtt);
+	MqttSub *sub = _mqtt_sub_find(mqtt, topic);
+	if(sub) sub->unsubid = msgid;
 	_mqtt_send_unsubscribe(mqtt, msgid, topic);
 	_mqtt_callback(mqtt, UNSUBSCRIBE, (void *)topic, msgid);
 	return msgid;
@@ -449,7 +2190,8 @@ mqtt_unsubscribe(Mqtt *mqtt, const char *topic) {
 static void 
 _mqtt_send_ping(Mqtt *mqtt) {
 	char buffer[2] = {PINGREQ, 0};
-	anetWrite(mqtt->fd, buffer, 2);
+	if(!mqtt->ping_sent) mqtt->ping_sent = mqtt_hist_now();
+	_mqtt_write(mqtt, buffer, 2);
 }
 
 //PINGREQ
@@ -462,22 +2204,64 @@ mqtt_ping(Mqtt *mqtt) {
 static void 
 _mqtt_send_disconnect(Mqtt *mqtt) {
 	char buffer[2] = {DISCONNECT, 0};
-	anetWrite(mqtt->fd, buffer, 2);
+	_mqtt_write(mqtt, buffer, 2);
 }
 
-//DISCONNECT
-void
-mqtt_disconnect(Mqtt *mqtt) {
-	_mqtt_send_disconnect(mqtt);
+static void _mqtt_stream_abort(Mqtt *mqtt);
+
+/*
+ * Close the connection. With drain, queued publishes and DISCONNECT go
+ * out first; a broken socket is closed right away, the queue dropped.
+ */
+static void
+_mqtt_close(Mqtt *mqtt, bool drain) {
+	_mqtt_race_stop(mqtt);
+	//lost or refused before CONNACK
+	if(mqtt->fd > 0 && mqtt->state == MQTT_STATE_CONNECTING) {
+		_mqtt_server_failed(mqtt, mqtt->server_current);
+	}
+	if(drain && mqtt->fd > 0 && mqtt->state == MQTT_STATE_CONNECTED) {
+		_mqtt_send_disconnect(mqtt);
+		_mqtt_output_drain(mqtt, MQTT_DRAIN_TIMEOUT);
+	}
+	_mqtt_output_clear(mqtt);
+	_mqtt_stream_abort(mqtt);
     if(mqtt->fd > 0) {
-        aeDeleteFileEvent(mqtt->el, mqtt->fd, AE_READABLE);
+        aeDeleteFileEvent(mqtt->el, mqtt->fd, AE_READABLE | AE_WRITABLE);
+        mqtt->write_pending = false;
+#ifdef MQTT_TLS
+        if(mqtt->tls) mqtt_tls_close(mqtt->tls);
+#endif
         close(mqtt->fd);
         mqtt->fd = -1;
     }
+    if(mqtt->keepalive_timer != -1) {
+        aeDeleteTimeEvent(mqtt->el, mqtt->keepalive_timer);
+        mqtt->keepalive_timer = -1;
+    }
+    if(mqtt->resume_timer != -1) {
+        aeDeleteTimeEvent(mqtt->el, mqtt->resume_timer);
+        mqtt->resume_timer = -1;
+    }
+    if(mqtt->probe_timer != -1) {
+        aeDeleteTimeEvent(mqtt->el, mqtt->probe_timer);
+        mqtt->probe_timer = -1;
+    }
+    MQTT_STAT_SET(mqtt->inbound_pending, 0);
+    mqtt->inbound_held = 0;
+    mqtt->read_throttled = false;
+    _mqtt_inflight_fail(mqtt, MQTT_ERR_CONNLOST, 0);
+    _mqtt_batch_flush(mqtt); //already acked, deliver them
     mqtt_set_state(mqtt, MQTT_STATE_DISCONNECTED);
 	_mqtt_callback(mqtt, CONNECT, NULL, MQTT_STATE_DISCONNECTED);
 }
 
+//DISCONNECT
+void
+mqtt_disconnect(Mqtt *mqtt) {
+	_mqtt_close(mqtt, true);
+}
+
 static void 
 _mqtt_sleep(struct aeEventLoop *evtloop) {
 	MQTT_NOTUSED(evtloop);
@@ -494,105 +2278,488 @@ mqtt_run(Mqtt *mqtt) {
 //RELEASE
 void 
 mqtt_release(Mqtt *mqtt) {
+	_mqtt_race_stop(mqtt);
+	//still connected: no DISCONNECT, the loop just forgets the socket
+	if(mqtt->fd > 0) {
+		aeDeleteFileEvent(mqtt->el, mqtt->fd, AE_READABLE | AE_WRITABLE);
+#ifdef MQTT_TLS
+		if(mqtt->tls) mqtt_tls_close(mqtt->tls);
+#endif
+		close(mqtt->fd);
+		mqtt->fd = -1;
+	}
 	if(mqtt->server) zfree(mqtt->server);
 	if(mqtt->username) zfree((void *)mqtt->username);
 	if(mqtt->password) zfree((void *)mqtt->password);
 	if(mqtt->clientid) zfree((void *)mqtt->clientid);
 	if(mqtt->will) mqtt_will_release(mqtt->will);
+	if(mqtt->dispatch) mqtt_dispatch_release(mqtt->dispatch);
+	if(mqtt->rbuf) zfree(mqtt->rbuf);
+	_mqtt_inflight_fail(mqtt, MQTT_ERR_CONNLOST, 0);
+	if(mqtt->inflight) zfree(mqtt->inflight);
+	if(mqtt->keepalive_timer != -1) aeDeleteTimeEvent(mqtt->el, mqtt->keepalive_timer);
+	if(mqtt->publish_timer != -1) aeDeleteTimeEvent(mqtt->el, mqtt->publish_timer);
+	if(mqtt->resume_timer != -1) aeDeleteTimeEvent(mqtt->el, mqtt->resume_timer);
+	if(mqtt->reconnect_timer != -1) aeDeleteTimeEvent(mqtt->el, mqtt->reconnect_timer);
+	if(mqtt->probe_timer != -1) aeDeleteTimeEvent(mqtt->el, mqtt->probe_timer);
+	mqtt_clear_servers(mqtt);
+	zfree(mqtt->ping_latency);
+	zfree(mqtt->publish_latency);
+	if(mqtt->trace) mqtt_trace_release(mqtt->trace);
+	if(mqtt->capture) mqtt_capture_close(mqtt->capture);
+	if(mqtt->stream) mqtt_msg_free(mqtt->stream);
+	_mqtt_batch_flush(mqtt);
+	if(mqtt->batch) zfree(mqtt->batch);
+	_mqtt_output_clear(mqtt);
+#ifdef MQTT_TLS
+	if(mqtt->tls) mqtt_tls_release(mqtt->tls);
+#endif
+	mqtt->topic_alias_max = 0;
+	_mqtt_alias_reset(mqtt, 0);
+	_mqtt_sub_clear(mqtt);
 	zfree(mqtt);
 }
 
 static int 
 _mqtt_keepalive(aeEventLoop *el, long long id, void *clientdata) {
 	assert(el);
-	MQTT_NOTUSED(id);
 	Mqtt *mqtt = (Mqtt *)clientdata;
 	_mqtt_send_ping(mqtt);
 	_mqtt_callback(mqtt, PINGREQ, NULL, 0);
+	//disconnected from the callback, this timer is gone
+	if(mqtt->keepalive_timer != id) return AE_NOMORE;
 	//FIXME: TIMEOUT
     //mqtt->keepalive->timeoutid = aeCreateTimeEvent(el, 
     //   period*2, mqtt_keepalive_timeout, mqtt, NULL);
 	return mqtt->keepalive*1000;
 }
 
+/*
+ * Probe pings only sample the round trip, one at a time since
+ * PINGRESP carries nothing to pair it with.
+ */
+static int
+_mqtt_ping_probe(aeEventLoop *el, long long id, void *clientdata) {
+	Mqtt *mqtt = (Mqtt *)clientdata;
+	MQTT_NOTUSED(el);
+	if(mqtt->probe_timer != id) return AE_NOMORE;
+	if(!mqtt->ping_sent) _mqtt_send_ping(mqtt);
+	//the write may have failed and dropped the connection
+	if(mqtt->probe_timer != id) return AE_NOMORE;
+	return mqtt->ping_probe;
+}
+
+static void
+_mqtt_ping_probe_start(Mqtt *mqtt) {
+	if(mqtt->probe_timer != -1) {
+		aeDeleteTimeEvent(mqtt->el, mqtt->probe_timer);
+		mqtt->probe_timer = -1;
+	}
+	if(mqtt->ping_probe > 0 && mqtt->state == MQTT_STATE_CONNECTED) {
+		mqtt->probe_timer = aeCreateTimeEvent(mqtt->el, mqtt->ping_probe,
+			_mqtt_ping_probe, mqtt, NULL);
+	}
+}
+
+void
+mqtt_set_ping_probe(Mqtt *mqtt, int interval) {
+	mqtt->ping_probe = interval;
+	_mqtt_ping_probe_start(mqtt);
+}
+
+const MqttHist *
+mqtt_get_ping_latency(Mqtt *mqtt) {
+	return mqtt->ping_latency;
+}
+
+const MqttHist *
+mqtt_get_publish_latency(Mqtt *mqtt) {
+	return mqtt->publish_latency;
+}
+
+void
+mqtt_reset_latency(Mqtt *mqtt) {
+	mqtt_hist_reset(mqtt->ping_latency);
+	mqtt_hist_reset(mqtt->publish_latency);
+}
+
+/*
+ * Each field is read whole, see MQTT_STAT_ADD, but the copy is not one
+ * snapshot: a counter may move while the others are read.
+ */
+void
+mqtt_get_stats(Mqtt *mqtt, MqttStats *stats) {
+	int i;
+	for(i = 0; i < 16; i++) {
+		stats->packets_in[i] = MQTT_STAT_GET(mqtt->stats.packets_in[i]);
+		stats->bytes_in[i] = MQTT_STAT_GET(mqtt->stats.bytes_in[i]);
+		stats->packets_out[i] = MQTT_STAT_GET(mqtt->stats.packets_out[i]);
+		stats->bytes_out[i] = MQTT_STAT_GET(mqtt->stats.bytes_out[i]);
+	}
+	stats->bytes_written = MQTT_STAT_GET(mqtt->stats.bytes_written);
+	stats->messages = MQTT_STAT_GET(mqtt->stats.messages);
+	stats->reconnects = MQTT_STAT_GET(mqtt->stats.reconnects);
+	stats->decode_errors = MQTT_STAT_GET(mqtt->stats.decode_errors);
+	stats->callback_us = MQTT_STAT_GET(mqtt->stats.callback_us);
+	stats->acks_pending = MQTT_STAT_GET(mqtt->inflight_count);
+	stats->acks_owed = MQTT_STAT_GET(mqtt->inbound_pending);
+	stats->output_bytes = MQTT_STAT_GET(mqtt->output_bytes);
+}
+
+void
+mqtt_set_trace(Mqtt *mqtt, int size) {
+	if(mqtt->trace) {
+		mqtt_trace_release(mqtt->trace);
+		mqtt->trace = NULL;
+	}
+	if(size > 0) mqtt->trace = mqtt_trace_new(size);
+}
+
+int
+mqtt_trace_dump(Mqtt *mqtt, const char *path) {
+	if(!mqtt->trace) {
+		_mqtt_set_error(mqtt->errstr, "tracing is off");
+		return MQTT_ERR;
+	}
+	if(mqtt_trace_write(mqtt->trace, path) < 0) {
+		_mqtt_set_error(mqtt->errstr, "trace dump to %s: %s", path, strerror(errno));
+		return MQTT_ERR;
+	}
+	return MQTT_OK;
+}
+
+/*
+ * The file records the protocol level set at this point, set it first.
+ * File ranges of mqtt_publish_fd are read back from their file.
+ */
+int
+mqtt_set_capture(Mqtt *mqtt, const char *path) {
+	if(mqtt->capture) {
+		mqtt_capture_close(mqtt->capture);
+		mqtt->capture = NULL;
+	}
+	if(!path) return MQTT_OK;
+	mqtt->capture = mqtt_capture_create(path, mqtt->protocol);
+	if(!mqtt->capture) {
+		_mqtt_set_error(mqtt->errstr, "capture to %s: %s", path, strerror(errno));
+		return MQTT_ERR;
+	}
+	return MQTT_OK;
+}
+
 /*--------------------------------------
 ** MQTT handler and reader.
 --------------------------------------*/
 static void
-_mqtt_handle_connack(Mqtt *mqtt, int rc) {
+_mqtt_handle_connack(Mqtt *mqtt, int rc, MqttProps *props) {
+	if(rc == CONNACK_ACCEPT) {
+		if(props->receive_max) mqtt->server_receive_max = props->receive_max;
+		mqtt->server_max_packet_size = props->max_packet_size;
+		if(props->server_keepalive) mqtt->keepalive = props->server_keepalive;
+		if(props->topic_alias_max) _mqtt_alias_reset(mqtt, props->topic_alias_max);
+	}
+	if(rc == CONNACK_ACCEPT) _mqtt_server_connected(mqtt);
 	_mqtt_callback(mqtt, CONNACK, NULL, rc);
 	if(rc == CONNACK_ACCEPT) {
 		mqtt->keepalive_timer = aeCreateTimeEvent(mqtt->el, 
 			mqtt->keepalive*1000, _mqtt_keepalive, mqtt, NULL);
 		mqtt_set_state(mqtt, MQTT_STATE_CONNECTED);
+		_mqtt_ping_probe_start(mqtt);
 		_mqtt_callback(mqtt, CONNECT, NULL, MQTT_STATE_CONNECTED);
 	} 
 }
 
+//in manual ack mode a QoS1/QoS2 message is owed its ack until mqtt_ack
+static void
+_mqtt_ack_owed(Mqtt *mqtt, const MqttMsg *msg) {
+	if(msg->qos == MQTT_QOS0) return;
+	MQTT_STAT_ADD(mqtt->inbound_pending, 1);
+}
+
+//held until mqtt_ack rather than until its callback returns
+static bool
+_mqtt_held_for_ack(Mqtt *mqtt, const MqttMsg *msg) {
+	return mqtt->manual_ack && msg->qos != MQTT_QOS0;
+}
+
 static void
 _mqtt_handle_publish(Mqtt *mqtt, MqttMsg *msg) {
-	if(msg->qos == MQTT_QOS1) {
-		mqtt_puback(mqtt, msg->id);
-	} else if(msg->qos == MQTT_QOS2) {
-		mqtt_pubrec(mqtt, msg->id);
+	MQTT_STAT_ADD(mqtt->stats.messages, 1);
+	msg->epoch = mqtt->epoch;
+	_mqtt_inbound_hold(mqtt);
+	if(!mqtt->manual_ack) {
+		_mqtt_publish_ack(mqtt, msg);
+	} else {
+		_mqtt_ack_owed(mqtt, msg);
+	}
+	if(mqtt->dispatch) {
+		mqtt_dispatch_push(mqtt->dispatch, msg);
+		return;
+	}
+	if(mqtt->batchcallback) {
+		mqtt->batch[mqtt->batch_count++] = msg;
+		if(mqtt->batch_count == mqtt->batch_max) _mqtt_batch_flush(mqtt);
+		return;
 	}
 	_mqtt_msg_callback(mqtt, msg);
+	if(!_mqtt_held_for_ack(mqtt, msg)) _mqtt_inbound_release(mqtt, msg);
+	mqtt_msg_free(msg);
+}
+
+/*
+ * Hand the gathered messages over, then free them. A resize asked for
+ * by the callback waits until the array is no longer used.
+ */
+static void
+_mqtt_batch_flush(Mqtt *mqtt) {
+	int i, count = mqtt->batch_count;
+	uint64_t start;
+	if(count == 0) return;
+	mqtt->batch_count = 0;
+	mqtt->batch_flushing = true;
+	if(mqtt->batchcallback) {
+		start = _mqtt_callback_start(mqtt);
+		mqtt->batchcallback(mqtt, mqtt->batch, count);
+		_mqtt_callback_end(mqtt, start);
+	}
+	for(i = 0; i < count; i++) {
+		if(!_mqtt_held_for_ack(mqtt, mqtt->batch[i])) {
+			_mqtt_inbound_release(mqtt, mqtt->batch[i]);
+		}
+		mqtt_msg_free(mqtt->batch[i]);
+	}
+	mqtt->batch_flushing = false;
+	if(mqtt->batch_resize) {
+		mqtt->batch = zrealloc(mqtt->batch, sizeof(MqttMsg *)*mqtt->batch_resize);
+		mqtt->batch_max = mqtt->batch_resize;
+		mqtt->batch_resize = 0;
+	}
+}
+
+/*
+ * Decode the PUBLISH variable header from the len bytes available.
+ * return the message without payload and set *vhlen to the header size.
+ * return NULL with *vhlen 0 when more bytes are needed, or with *vhlen
+ * -1 when the header is malformed.
+ */
+static MqttMsg *
+_mqtt_read_publish(Mqtt *mqtt, uint8_t header, char *buffer, int len, int *vhlen) {
+	int qos = GETQOS(header);
+	int msgid = 0, topiclen, need, count, size;
+	char *topic, *ptr = buffer;
+	MqttProps props;
+
+	*vhlen = 0;
+	if(len < 2) return NULL;
+	need = 2 + 256*(uint8_t)buffer[0] + (uint8_t)buffer[1] + (qos ? 2 : 0);
+	if(need > len) return NULL;
+	if(mqtt->protocol == MQTT_PROTO_V5) {
+		size = _peek_remaining_length(buffer+need, len-need, &count);
+		if(size == -1 || need + count + size > len) return NULL;
+		if(size < 0) {
+			*vhlen = -1;
+			return NULL;
+		}
+	}
+	topic = _read_string_len(&ptr, &topiclen);
+	if(qos > 0) {
+		msgid = _read_int(&ptr);
+	}
+	memset(&props, 0, sizeof(props));
+	if(mqtt->protocol == MQTT_PROTO_V5 &&
+		_read_properties(&ptr, len-(ptr-buffer), &props) < 0) {
+		zfree(topic);
+		*vhlen = -1;
+		return NULL;
+	}
+	if(props.topic_alias) {
+		topic = _mqtt_alias_in(mqtt, props.topic_alias, topic, topiclen);
+		if(!topic) {
+			*vhlen = -1;
+			return NULL;
+		}
+	}
+	*vhlen = ptr - buffer;
+	return mqtt_msg_new(msgid, qos, GETRETAIN(header), GETDUP(header), topic, 0, NULL);
+}
+
+/*
+ * Pass up to len payload bytes of the streamed publish to the callback,
+ * then ack and release it once the whole payload has been seen.
+ */
+static int
+_mqtt_stream_feed(Mqtt *mqtt, char *buffer, int len) {
+	MqttMsg *msg = mqtt->stream;
+	int n = msg->payloadlen - mqtt->stream_offset;
+	if(n > len) n = len;
+	if(n > 0) {
+		if(mqtt->streamcallback) {
+			mqtt->streamcallback(mqtt, msg, mqtt->stream_offset, buffer, n);
+		}
+		if(mqtt->stream != msg) return n; //aborted in callback
+		mqtt->stream_offset += n;
+	}
+	if(mqtt->stream_offset == msg->payloadlen) {
+		mqtt->stream = NULL;
+		//in manual ack mode it was counted when it started
+		if(!mqtt->manual_ack) _mqtt_publish_ack(mqtt, msg);
+		if(!_mqtt_held_for_ack(mqtt, msg)) _mqtt_inbound_release(mqtt, msg);
+		mqtt_msg_free(msg);
+	}
+	return n;
+}
+
+/*
+ * Start streaming the publish at the head of buffer as soon as its
+ * variable header is in. return bytes consumed, 0 when more bytes are
+ * needed or -1 when the header is malformed.
+ */
+static int
+_mqtt_stream_begin(Mqtt *mqtt, char *buffer, int len, int remaining_count, int remaining_length) {
+	MqttMsg *msg;
+	int vhlen, n = 1 + remaining_count;
+	int avail = (len - n < remaining_length) ? len - n : remaining_length;
+
+	msg = _mqtt_read_publish(mqtt, (uint8_t)buffer[0], buffer+n, avail, &vhlen);
+	if(!msg) return vhlen;
+	MQTT_STAT_ADD(mqtt->stats.packets_in[PUBLISH >> 4], 1);
+	MQTT_STAT_ADD(mqtt->stats.bytes_in[PUBLISH >> 4], n + remaining_length);
+	MQTT_STAT_ADD(mqtt->stats.messages, 1);
+	MQTT_TRACE(mqtt->trace, MQTT_TRACE_DECODE, PUBLISH >> 4, msg->id,
+		n + remaining_length);
+	msg->payloadlen = remaining_length - vhlen;
+	msg->epoch = mqtt->epoch;
+	_mqtt_inbound_hold(mqtt);
+	if(mqtt->manual_ack) _mqtt_ack_owed(mqtt, msg);
+	mqtt->stream = msg;
+	mqtt->stream_offset = 0;
+	mqtt->streamcallback(mqtt, msg, 0, NULL, 0);
+	n += vhlen;
+	if(mqtt->stream != msg) return n;
+	return n + _mqtt_stream_feed(mqtt, buffer+n, len-n);
+}
+
+static void
+_mqtt_stream_abort(Mqtt *mqtt) {
+	MqttMsg *msg = mqtt->stream;
+	if(!msg) return;
+	mqtt->stream = NULL;
+	if(mqtt->streamcallback) {
+		mqtt->streamcallback(mqtt, msg, mqtt->stream_offset, NULL, -1);
+	}
+	if(!_mqtt_held_for_ack(mqtt, msg)) _mqtt_inbound_release(mqtt, msg);
 	mqtt_msg_free(msg);
 }
 
 static void
 _mqtt_handle_puback(Mqtt *mqtt, int type, int msgid) {
-	if(type == PUBREL) {
-		mqtt_pubcomp(mqtt, msgid);
+	MqttInflight *slot = _mqtt_inflight_find(mqtt, msgid);
+	MqttPublishCallback callback;
+	void *ctx;
+	switch(type) {
+	case PUBREL:
+		_mqtt_queue_ack(mqtt, PUBCOMP, msgid);
+		break;
+	case PUBREC:
+		if(slot) _mqtt_queue_ack(mqtt, SETQOS(PUBREL, MQTT_QOS1), msgid);
+		break;
+	case PUBACK:
+	case PUBCOMP:
+		if(slot) {
+			if(slot->sent) mqtt_hist_record(mqtt->publish_latency, mqtt_hist_now() - slot->sent);
+			callback = slot->callback;
+			ctx = slot->ctx;
+			_mqtt_inflight_remove(mqtt, slot);
+			if(callback) callback(mqtt, msgid, MQTT_OK, ctx);
+		}
+		break;
 	}
 	_mqtt_callback(mqtt, type, NULL, msgid);
 }
 
+/*
+ * One granted qos per topic, in the order the topics were sent.
+ */
 static void
-_mqtt_handle_suback(Mqtt *mqtt, int msgid, int qos) {
-	MQTT_NOTUSED(qos);
+_mqtt_handle_suback(Mqtt *mqtt, int msgid, char *codes, int count) {
+	int i = 0;
+	uint8_t qos;
+	MqttSub *sub, *next;
+	for(sub = mqtt->subs; sub && i < count; sub = next) {
+		next = sub->next;
+		if(sub->msgid != msgid) continue;
+		qos = (uint8_t)codes[i++];
+		if(qos >= 0x80) { //failure
+			_mqtt_sub_remove(mqtt, sub);
+		} else {
+			sub->qos = qos;
+			sub->msgid = 0;
+		}
+	}
 	_mqtt_callback(mqtt, SUBACK, NULL, msgid);
 }
 
 static void
 _mqtt_handle_unsuback(Mqtt *mqtt, int msgid) {
+	MqttSub *sub, *next;
+	for(sub = mqtt->subs; sub; sub = next) {
+		next = sub->next;
+		if(sub->unsubid == msgid) _mqtt_sub_remove(mqtt, sub);
+	}
 	_mqtt_callback(mqtt, UNSUBACK, NULL, msgid);
 }
 
 static void
 _mqtt_handle_pingresp(Mqtt *mqtt) {
+	uint64_t rtt;
+	if(mqtt->ping_sent) {
+		rtt = mqtt_hist_now() - mqtt->ping_sent;
+		mqtt->ping_sent = 0;
+		mqtt_hist_record(mqtt->ping_latency, rtt);
+		_mqtt_server_pong(mqtt, rtt);
+	}
 	_mqtt_callback(mqtt, PINGRESP, NULL, 0);
 }
 
 static void 
 _mqtt_handle_packet(Mqtt *mqtt, uint8_t header, char *buffer, int buflen) {
-	int qos, msgid=0;
-	bool retain, dup;
-	int topiclen = 0;
-	char *topic = NULL;
+	int msgid=0, rc, vhlen;
 	char *payload = NULL;
+	char *end = buffer + buflen;
 	int payloadlen = buflen;
 	MqttMsg *msg = NULL;
+	MqttProps props;
 	uint8_t type = GETTYPE(header); 
+	bool v5 = (mqtt->protocol == MQTT_PROTO_V5);
+	memset(&props, 0, sizeof(props));
+	MQTT_TRACE(mqtt->trace, MQTT_TRACE_HANDLE_START, type >> 4, 0, buflen);
 	switch (type) {
 	case CONNACK:
 		_read_char(&buffer);
-		_mqtt_handle_connack(mqtt, _read_char(&buffer));
+		rc = (uint8_t)_read_char(&buffer);
+		if(v5 && buflen > 2 && _read_properties(&buffer, end-buffer, &props) < 0) {
+			_mqtt_set_error(mqtt->errstr, "badpacket: connack properties");
+			MQTT_STAT_ADD(mqtt->stats.decode_errors, 1);
+			_mqtt_drop(mqtt);
+			break;
+		}
+		_mqtt_handle_connack(mqtt, rc, &props);
 		break;
 	case PUBLISH:
-		qos = GETQOS(header);;
-		retain = GETRETAIN(header);
-		dup = GETDUP(header);
-		topic = _read_string_len(&buffer, &topiclen);
-		payloadlen -= (2+topiclen);
-		if( qos > 0) {
-			msgid = _read_int(&buffer);
-			payloadlen -= 2;
+		msg = _mqtt_read_publish(mqtt, header, buffer, buflen, &vhlen);
+		if(!msg) {
+			_mqtt_set_error(mqtt->errstr, "badpacket: publish length=%d", buflen);
+			MQTT_STAT_ADD(mqtt->stats.decode_errors, 1);
+			_mqtt_drop(mqtt);
+			break;
 		}
+		payloadlen = buflen - vhlen;
 		payload = zmalloc(payloadlen+1);
-		memcpy(payload, buffer, payloadlen);
+		memcpy(payload, buffer+vhlen, payloadlen);
 		payload[payloadlen] = '\0';
-		msg = mqtt_msg_new(msgid, qos, retain, dup, topic, payloadlen, payload);
+		msg->payloadlen = payloadlen;
+		msg->payload = payload;
+		msgid = msg->id;
 		_mqtt_handle_publish(mqtt, msg);
 		break;
 	case PUBACK:
@@ -604,8 +2771,13 @@ _mqtt_handle_packet(Mqtt *mqtt, uint8_t header, char *buffer, int buflen) {
 		break;
 	case SUBACK:
 		msgid = _read_int(&buffer);
-		qos = _read_char(&buffer);
-		_mqtt_handle_suback(mqtt, msgid, qos);
+		if(v5 && _read_properties(&buffer, end-buffer, &props) < 0) {
+			_mqtt_set_error(mqtt->errstr, "badpacket: suback properties");
+			MQTT_STAT_ADD(mqtt->stats.decode_errors, 1);
+			_mqtt_drop(mqtt);
+			break;
+		}
+		_mqtt_handle_suback(mqtt, msgid, buffer, end-buffer);
 		break;
 	case UNSUBACK:
 		msgid = _read_int(&buffer);
@@ -614,54 +2786,317 @@ _mqtt_handle_packet(Mqtt *mqtt, uint8_t header, char *buffer, int buflen) {
 	case PINGRESP:
 		_mqtt_handle_pingresp(mqtt);
 		break;
+	case DISCONNECT: //MQTT 5, the broker closes the socket next
+		rc = (buflen > 0) ? (uint8_t)_read_char(&buffer) : 0;
+		_mqtt_set_error(mqtt->errstr, "disconnected by server: reason=%d", rc);
+		break;
 	default:
 		_mqtt_set_error(mqtt->errstr, "badheader: %d", type);
+		MQTT_STAT_ADD(mqtt->stats.decode_errors, 1);
 	}
+	MQTT_TRACE(mqtt->trace, MQTT_TRACE_HANDLE_END, type >> 4, msgid, buflen);
 }
 
+/*
+ * Handle every complete packet in the read buffer. A partial packet
+ * is kept at the head of the buffer until the rest of it arrives.
+ */
 static void 
-_mqtt_reader_feed(Mqtt *mqtt, char *buffer, int len) {
+_mqtt_reader_feed(Mqtt *mqtt) {
 	uint8_t header;
-	char *ptr = buffer;
+	char *ptr = mqtt->rbuf;
+	int len = mqtt->rlen;
+	int n, packetlen, limit;
 	int remaining_length;
 	int remaining_count;
-	
-	header = _read_header(&ptr);
-	
-	remaining_length = _decode_remaining_length(&ptr, &remaining_count);
-	if( (1+remaining_count+remaining_length) != len ) {
-		_mqtt_set_error(mqtt->errstr, "badpacket: remaing_length=%d, remaing_count=%d, len=%d",
-			remaining_length, remaining_count, len);	
-		return;
+	bool stream;
+
+	//payload of a streamed publish goes straight to the callback
+	if(mqtt->stream) {
+		n = _mqtt_stream_feed(mqtt, ptr, len);
+		ptr += n;
+		len -= n;
+	}
+
+	while(len >= 2 && !mqtt->stream && mqtt->state != MQTT_STATE_DISCONNECTED &&
+		_mqtt_reading(mqtt)) {
+		remaining_length = _peek_remaining_length(ptr+1, len-1, &remaining_count);
+		if(remaining_length == -1) break;
+		if(remaining_length < 0) {
+			_mqtt_set_error(mqtt->errstr, "badpacket: remaining_count=%d, len=%d",
+				remaining_count, len);
+			MQTT_STAT_ADD(mqtt->stats.decode_errors, 1);
+			_mqtt_drop(mqtt);
+			break;
+		}
+		packetlen = 1+remaining_count+remaining_length;
+		stream = GETTYPE((uint8_t)ptr[0]) == PUBLISH && mqtt->streamcallback &&
+			remaining_length >= mqtt->stream_threshold;
+		//without a limit of our own, cap what is buffered whole
+		limit = mqtt->max_packet_size;
+		if(!limit && !stream) limit = MQTT_MAX_PACKET_SIZE;
+		if(limit && packetlen > limit) {
+			_mqtt_set_error(mqtt->errstr, "badpacket: packet too large %d", packetlen);
+			MQTT_STAT_ADD(mqtt->stats.decode_errors, 1);
+			_mqtt_drop(mqtt);
+			break;
+		}
+		if(stream) {
+			n = _mqtt_stream_begin(mqtt, ptr, len, remaining_count, remaining_length);
+			if(n < 0) {
+				_mqtt_set_error(mqtt->errstr, "badpacket: publish length=%d", remaining_length);
+				MQTT_STAT_ADD(mqtt->stats.decode_errors, 1);
+				_mqtt_drop(mqtt);
+			}
+			if(n <= 0) break;
+			ptr += n;
+			len -= n;
+			continue;
+		}
+		if(packetlen > len) {
+			//make room for the whole packet at once
+			if(packetlen > mqtt->rsize) {
+				mqtt->rsize = packetlen;
+				mqtt->rbuf = zrealloc(mqtt->rbuf, mqtt->rsize);
+				ptr = mqtt->rbuf + (mqtt->rlen - len);
+			}
+			break;
+		}
+		header = _read_header(&ptr);
+		MQTT_STAT_ADD(mqtt->stats.packets_in[header >> 4], 1);
+		MQTT_STAT_ADD(mqtt->stats.bytes_in[header >> 4], packetlen);
+		MQTT_TRACE(mqtt->trace, MQTT_TRACE_DECODE, header >> 4, 0, packetlen);
+		ptr += remaining_count;
+		_mqtt_handle_packet(mqtt, header, ptr, remaining_length);
+		ptr += remaining_length;
+		len -= packetlen;
+	}
+	_mqtt_batch_flush(mqtt);
+	if(mqtt->state == MQTT_STATE_DISCONNECTED) len = 0;
+	if(len > 0 && ptr != mqtt->rbuf) memmove(mqtt->rbuf, ptr, len);
+	mqtt->rlen = len;
+	//give back memory held for a large packet
+	if(len == 0 && mqtt->rsize > MQTT_BUFFER_SIZE*4) {
+		zfree(mqtt->rbuf);
+		mqtt->rbuf = NULL;
+		mqtt->rsize = 0;
 	}
-	_mqtt_handle_packet(mqtt, header, ptr, remaining_length);
 }
 
 static void 
 _mqtt_read(aeEventLoop *el, int fd, void *privdata, int mask) {
-    int nread, timeout;
+    int nread;
 	Mqtt *mqtt = (Mqtt *)privdata;
-	char buffer[MQTT_BUFFER_SIZE];
 
+	MQTT_NOTUSED(el);
+	MQTT_NOTUSED(fd);
 	MQTT_NOTUSED(mask);
 
-    nread = read(fd, buffer, MQTT_BUFFER_SIZE);
+	if(mqtt->rsize - mqtt->rlen < MQTT_BUFFER_SIZE) {
+		mqtt->rsize = mqtt->rlen + MQTT_BUFFER_SIZE;
+		mqtt->rbuf = zrealloc(mqtt->rbuf, mqtt->rsize);
+	}
+    nread = _mqtt_sock_read(mqtt, mqtt->rbuf+mqtt->rlen, mqtt->rsize-mqtt->rlen);
     if (nread < 0) {
         if (errno == EAGAIN) {
             return;
         } else {
 			mqtt->error = errno;
 			_mqtt_set_error(mqtt->errstr, "socket error: %d.", errno);
+			_mqtt_drop(mqtt);
         }
     } else if (nread == 0) {
-        mqtt_disconnect(mqtt);
-		timeout = (random() % 300) * 1000,
-		aeCreateTimeEvent(el, timeout, _mqtt_reconnect, mqtt, NULL);
+        _mqtt_drop(mqtt);
     } else {
-        _mqtt_reader_feed(mqtt, buffer, nread);
+        MQTT_TRACE(mqtt->trace, MQTT_TRACE_READ, 0, 0, nread);
+        if(mqtt->capture) {
+            struct iovec iov = {.iov_base = mqtt->rbuf + mqtt->rlen, .iov_len = nread};
+            mqtt_capture_append(mqtt->capture, MQTT_CAPTURE_READ, &iov, 1, nread);
+        }
+        mqtt->rlen += nread;
+        if(mqtt->sockopts.quickack && !mqtt->unix_sock) {
+            anetTcpQuickAck(NULL, mqtt->fd);
+        }
+        _mqtt_reader_feed(mqtt);
+        //acks queued by the whole read go out together
+        if(mqtt->output_bytes > 0) _mqtt_flush(mqtt);
     }
 }
 
+/*
+ * Packets are handled, and acked when there is a socket, as if the
+ * bytes came from the broker. return MQTT_ERR once the client dropped
+ * the connection, on a malformed packet for one.
+ */
+int
+mqtt_feed(Mqtt *mqtt, const char *buf, int len) {
+	if(mqtt->rsize - mqtt->rlen < len) {
+		mqtt->rsize = mqtt->rlen + len;
+		mqtt->rbuf = zrealloc(mqtt->rbuf, mqtt->rsize);
+	}
+	memcpy(mqtt->rbuf + mqtt->rlen, buf, len);
+	mqtt->rlen += len;
+	_mqtt_reader_feed(mqtt);
+	return mqtt->state == MQTT_STATE_DISCONNECTED ? MQTT_ERR : MQTT_OK;
+}
+
+/*--------------------------------------
+** MQTT packet builders for mqttc-bench.
+--------------------------------------*/
+int
+mqtt_encode_publish(Mqtt *mqtt, MqttMsg *msg) {
+	size_t queued = mqtt->output_bytes;
+	_mqtt_send_publish(mqtt, msg);
+	return mqtt->output_bytes > queued ? MQTT_OK : MQTT_ERR;
+}
+
+void
+mqtt_encode_subscribe(Mqtt *mqtt, int msgid, const char *topic, uint8_t qos) {
+	_mqtt_send_subscribe(mqtt, msgid, topic, qos);
+}
+
+void
+mqtt_encode_connect(Mqtt *mqtt) {
+	_mqtt_send_connect(mqtt);
+}
+
+/*
+ * Popped as a write would, so the last chunk is reused as it is on a
+ * live connection.
+ */
+size_t
+mqtt_output_take(Mqtt *mqtt, char *buf, size_t size) {
+	size_t len, copied = 0, queued = mqtt->output_bytes;
+	MqttOutput *out;
+	for(out = mqtt->output; buf && out && copied < size; out = out->next) {
+		if(out->fd >= 0) continue;
+		len = out->len - out->pos;
+		if(len > size - copied) len = size - copied;
+		memcpy(buf + copied, out->buf + out->pos, len);
+		copied += len;
+	}
+	while(mqtt->output && mqtt->output_bytes > 0) _mqtt_output_pop(mqtt, MQTT_OK);
+	return queued;
+}
+
+/*--------------------------------------
+** MQTT read flow control.
+--------------------------------------*/
+static bool
+_mqtt_reading(Mqtt *mqtt) {
+	return !mqtt->read_paused && !mqtt->read_throttled && !mqtt->read_backlog;
+}
+
+/*
+ * Frames already in the read buffer when reading resumes get no
+ * readable event. Handle them first and only then read the socket
+ * again, so the buffer does not grow while we catch up.
+ */
+static int
+_mqtt_resume_feed(aeEventLoop *el, long long id, void *clientdata) {
+	Mqtt *mqtt = (Mqtt *)clientdata;
+	MQTT_NOTUSED(el);
+	if(mqtt->resume_timer != id) return AE_NOMORE;
+	mqtt->resume_timer = -1;
+	if(mqtt->fd <= 0 || !_mqtt_reading(mqtt)) return AE_NOMORE;
+	_mqtt_reader_feed(mqtt);
+	if(mqtt->output_bytes > 0) _mqtt_flush(mqtt);
+	if(mqtt->fd > 0 && _mqtt_reading(mqtt)) {
+		aeCreateFileEvent(mqtt->el, mqtt->fd, AE_READABLE, (aeFileProc *)_mqtt_read, (void *)mqtt);
+	}
+	return AE_NOMORE;
+}
+
+//start or stop reading when a flag change flipped it
+static void
+_mqtt_read_apply(Mqtt *mqtt, bool was) {
+	if(was == _mqtt_reading(mqtt) || mqtt->fd <= 0) return;
+	if(!was) {
+		if(mqtt->rlen == 0) {
+			aeCreateFileEvent(mqtt->el, mqtt->fd, AE_READABLE, (aeFileProc *)_mqtt_read, (void *)mqtt);
+		} else if(mqtt->resume_timer == -1) {
+			mqtt->resume_timer = aeCreateTimeEvent(mqtt->el, 0, _mqtt_resume_feed, mqtt, NULL);
+		}
+	} else {
+		aeDeleteFileEvent(mqtt->el, mqtt->fd, AE_READABLE);
+	}
+}
+
+static void
+_mqtt_read_set(Mqtt *mqtt, bool paused, bool throttled) {
+	bool was = _mqtt_reading(mqtt);
+	mqtt->read_paused = paused;
+	mqtt->read_throttled = throttled;
+	_mqtt_read_apply(mqtt, was);
+}
+
+/*
+ * The dispatch rings are full, or no longer. Separate from the pause
+ * of the application, neither lifts the other.
+ */
+void
+mqtt_read_backlog(Mqtt *mqtt, bool full) {
+	bool was = _mqtt_reading(mqtt);
+	mqtt->read_backlog = full;
+	_mqtt_read_apply(mqtt, was);
+}
+
+/*
+ * While reading is paused the socket is left alone, so TCP flow
+ * control pushes back on the broker. Frames already read stay buffered.
+ */
+void
+mqtt_pause_reading(Mqtt *mqtt) {
+	_mqtt_read_set(mqtt, true, mqtt->read_throttled);
+}
+
+void
+mqtt_resume_reading(Mqtt *mqtt) {
+	_mqtt_read_set(mqtt, false, mqtt->read_throttled);
+}
+
+/*
+ * A message is held from delivery until its callback returns, its
+ * batch is handed over, a dispatch worker is done with it or, in
+ * manual ack mode for QoS1/QoS2, mqtt_ack. Reading stops at the high
+ * watermark.
+ */
+static void
+_mqtt_inbound_hold(Mqtt *mqtt) {
+	mqtt->inbound_held++;
+	if(mqtt->read_high && mqtt->inbound_held >= mqtt->read_high) {
+		_mqtt_read_set(mqtt, mqtt->read_paused, true);
+	}
+}
+
+//messages of an earlier connection were dropped from the count
+static void
+_mqtt_inbound_release(Mqtt *mqtt, const MqttMsg *msg) {
+	if((msg->epoch && msg->epoch != mqtt->epoch) || mqtt->inbound_held == 0) return;
+	mqtt->inbound_held--;
+	if(mqtt->read_throttled && mqtt->inbound_held <= mqtt->read_low) {
+		_mqtt_read_set(mqtt, mqtt->read_paused, false);
+	}
+}
+
+void
+mqtt_inbound_release(Mqtt *mqtt, const MqttMsg *msg) {
+	_mqtt_inbound_release(mqtt, msg);
+}
+
+/*
+ * Pause reading when high messages are held, see _mqtt_inbound_hold,
+ * and resume once they are down to low. high 0 turns it off.
+ */
+void
+mqtt_set_read_watermarks(Mqtt *mqtt, int high, int low) {
+	mqtt->read_high = high;
+	mqtt->read_low = low < high ? low : high;
+	if(mqtt->read_throttled && (!high || mqtt->inbound_held <= mqtt->read_low)) {
+		_mqtt_read_set(mqtt, mqtt->read_paused, false);
+	}
+}
+
 MqttWill *
 mqtt_will_new(char *topic, char *msg, bool retain, uint8_t qos) {
 	MqttWill *will = zmalloc(sizeof(MqttWill));
@@ -690,6 +3125,7 @@ mqtt_msg_new(int msgid, int qos, bool retain, bool dup,
 	msg->topic = topic;
 	msg->payloadlen = payloadlen;
 	msg->payload = payload;
+	msg->epoch = 0;
 	return msg;
 }
 
@@ -37,6 +37,8 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #include "ae.h"
 
@@ -48,7 +50,16 @@
 
 #define MQTT_PROTOCOL_VERSION "MQTT/3.1"
 
+/*
+ * MQTT Protocol Level
+ */
+#define MQTT_PROTO_V31 3
+#define MQTT_PROTO_V311 4
+#define MQTT_PROTO_V5 5
+
 #define MQTT_ERR_SOCKET (-5)
+#define MQTT_ERR_TIMEOUT (-6)
+#define MQTT_ERR_CONNLOST (-7)
 
 /*
  * MQTT QOS
@@ -100,14 +111,150 @@ typedef struct {
 	const char *topic;
 	int payloadlen;
 	const char *payload;
+	uint32_t epoch; //connection it was delivered on, 0 for none
 } MqttMsg;
 
+/*
+ * MQTT Subscription, kept to replay after reconnect
+ */
+typedef struct _MqttSub {
+	char *topic;
+	uint8_t qos;
+	int msgid; //pending SUBSCRIBE
+	int unsubid; //pending UNSUBSCRIBE
+	struct _MqttSub *next;
+} MqttSub;
+
 typedef struct _Mqtt Mqtt;
 
+/*
+ * Publish completion, called once per mqtt_publish_ex: status is MQTT_OK
+ * on PUBACK/PUBCOMP (QOS0 as soon as it is queued), MQTT_ERR_TIMEOUT or
+ * MQTT_ERR_CONNLOST.
+ */
+typedef void (*MqttPublishCallback)(Mqtt *mqtt, int msgid, int status, void *ctx);
+
+/*
+ * MQTT In-flight QOS1/QOS2 publish
+ */
+typedef struct {
+	uint16_t id; //0 when the slot is free
+	uint8_t qos;
+	MqttPublishCallback callback; //NULL for a plain mqtt_publish
+	void *ctx;
+	uint64_t sent; //us
+} MqttInflight;
+
+/*
+ * MQTT 5 outbound topic alias, alias number is slot index + 1
+ */
+typedef struct {
+	char *topic;
+	int topiclen;
+	uint32_t hash;
+	unsigned long used; //lru clock
+} MqttAlias;
+
+/*
+ * MQTT Socket Options, applied at connect time. Zero keeps the kernel
+ * default. Only buffer sizes and busy polling apply to unix sockets.
+ */
+typedef struct {
+	bool nodelay;
+	int sndbuf;
+	int rcvbuf;
+	int keepalive; //TCP keepalive probe interval in seconds
+	int busy_poll; //SO_BUSY_POLL usecs
+	bool quickack; //re-armed after every read
+	int notsent_lowat;
+	bool cork; //cork flushes that write more than one chunk
+} MqttSockOpts;
+
+/*
+ * MQTT Server, one entry of the failover list and its health
+ */
+typedef struct {
+	char *host; //host name, ip address or unix:/path
+	int port;
+	double connect_ms; //moving average, connect to CONNACK
+	double rtt_ms; //moving average of ping round trips
+	int connects;
+	int pings;
+	int failures; //in a row
+} MqttServer;
+
+/*
+ * MQTT Stats, counters of one client. Per packet arrays are indexed
+ * by packet type, header >> 4.
+ */
+typedef struct {
+	uint64_t packets_in[16];
+	uint64_t bytes_in[16];
+	uint64_t packets_out[16]; //queued for write
+	uint64_t bytes_out[16];
+	uint64_t bytes_written; //to the socket, file ranges included
+	uint64_t messages; //delivered to the application
+	uint64_t reconnects;
+	uint64_t decode_errors;
+	uint64_t callback_us; //time spent in callbacks, see mqtt_set_callback_timing
+	int acks_pending; //own publishes waiting for PUBACK or PUBCOMP
+	int acks_owed; //manual acks not yet given
+	size_t output_bytes; //queued, not yet written
+} MqttStats;
+
+/*
+ * MQTT Prepared Topic, header flags and topic encoded once
+ */
+typedef struct {
+	Mqtt *mqtt;
+	uint8_t qos;
+	bool retain;
+	uint8_t header;
+	const char *topic; //points into encoded
+	int encodedlen;
+	char *encoded; //length-prefixed topic
+} MqttTopicHandle;
+
 typedef void (*MqttCallback)(Mqtt *mqtt, void *data, int id);
 
 typedef void (*MqttMsgCallback)(Mqtt *mqtt, MqttMsg *message);
 
+/*
+ * Batched delivery: messages decoded from one read, valid until the
+ * callback returns.
+ */
+typedef void (*MqttBatchCallback)(Mqtt *mqtt, MqttMsg **messages, int count);
+
+/*
+ * Streamed publish: called once with offset 0 and a NULL chunk when the
+ * message starts (msg->payloadlen is the total length), then once per
+ * chunk. A NULL chunk with len -1 means the connection was lost first.
+ * In manual ack mode it is owed its ack from the first call, until mqtt_ack.
+ */
+typedef void (*MqttStreamCallback)(Mqtt *mqtt, MqttMsg *msg, int offset, const char *chunk, int len);
+
+/*
+ * File publish done: status is MQTT_OK once the payload is written out,
+ * MQTT_ERR when the connection went away first.
+ */
+typedef void (*MqttFileCallback)(Mqtt *mqtt, int fd, int status, void *privdata);
+
+/*
+ * MQTT Output, encoded packets or a file range waiting for the socket
+ */
+typedef struct _MqttOutput {
+	char *buf;
+	int size;
+	int len;
+	int pos; //written so far
+	int fd; //file range when >= 0
+	off_t offset;
+	size_t remaining;
+	MqttFileCallback callback;
+	void *privdata;
+	struct _MqttOutput *next;
+} MqttOutput;
+
 struct _Mqtt {
 
 	aeEventLoop *el;
@@ -136,6 +283,46 @@ struct _Mqtt {
 
 	bool cleansess;
 
+	uint8_t protocol;
+
+	/* flow control: ours go in CONNECT, the broker's come in CONNACK */
+
+	int receive_max;
+
+	int max_packet_size;
+
+	int server_receive_max;
+
+	int server_max_packet_size;
+
+	/* topic aliases */
+
+	int topic_alias_max;
+
+	char **topic_aliases; //inbound, set by the broker
+
+	int topic_aliases_size;
+
+	MqttAlias *aliases; //outbound, capped by the broker
+
+	int alias_count;
+
+	uint32_t *alias_seen; //hashes of topics sent once without an alias
+
+	unsigned long alias_clock;
+
+	/* in-flight window */
+
+	MqttInflight *inflight;
+
+	int inflight_count;
+
+	int inflight_size;
+
+	int publish_timeout; //ms, 0 waits forever
+
+	long long publish_timer;
+
     /* keep alive */
 
 	unsigned int keepalive;
@@ -152,6 +339,126 @@ struct _Mqtt {
 
 	MqttMsgCallback msgcallback;
 
+	bool manual_ack;
+
+	/* batched delivery */
+
+	MqttBatchCallback batchcallback;
+
+	MqttMsg **batch;
+
+	int batch_count;
+
+	int batch_max;
+
+	bool batch_flushing; //the batch callback is running
+
+	int batch_resize; //batch_max to apply once it returns
+
+	bool callback_timing; //callback_us is counted
+
+	/* streaming delivery of large payloads */
+
+	MqttStreamCallback streamcallback;
+
+	int stream_threshold;
+
+	MqttMsg *stream;
+
+	int stream_offset;
+
+	/* subscription registry */
+
+	MqttSub *subs;
+
+	/* read buffer */
+
+	char *rbuf;
+
+	int rlen;
+
+	int rsize;
+
+	/* read flow control */
+
+	bool read_paused;
+
+	bool read_throttled;
+
+	bool read_backlog; //the dispatch rings are full
+
+	int inbound_pending;
+
+	int inbound_held; //delivered, not yet done with
+
+	uint32_t epoch; //bumped by every connect, stale acks are dropped
+
+	int read_high;
+
+	int read_low;
+
+	long long resume_timer;
+
+	/* output queue, drained by the writable handler */
+
+	MqttOutput *output;
+
+	MqttOutput *output_tail;
+
+	size_t output_bytes;
+
+	bool write_pending;
+
+	struct _MqttTls *tls;
+
+	bool unix_sock; //connected over AF_UNIX, set at connect
+
+	MqttSockOpts sockopts;
+
+	/* worker threads for messages, see dispatch.h */
+
+	struct _MqttDispatch *dispatch;
+
+	/* failover list */
+
+	MqttServer *servers;
+
+	int server_count;
+
+	int server_current;
+
+	int server_round; //failed attempts since the last CONNACK
+
+	bool connect_race;
+
+	int race_fds[2]; //connects in flight, -1 when none
+
+	int race_index[2]; //their servers
+
+	long long race_timer;
+
+	long long connect_start;
+
+	uint64_t ping_sent; //us, of the oldest unanswered ping
+
+	long long reconnect_timer;
+
+	/* latency, see hist.h */
+
+	struct _MqttHist *ping_latency;
+
+	struct _MqttHist *publish_latency; //PUBLISH to PUBACK or PUBCOMP
+
+	int ping_probe;
+
+	long long probe_timer;
+
+	MqttStats stats;
+
+	struct _MqttTrace *trace; //NULL unless tracing
+
+	struct _MqttCapture *capture; //NULL unless capturing
+
 	bool shutdown_asap;
 
 };
@@ -166,10 +473,38 @@ void mqtt_set_username(Mqtt *mqtt, const char *username);
 
 void mqtt_set_passwd(Mqtt *mqtt, const char *passwd);
 
+//host name, ip address or unix:/path
 void mqtt_set_server(Mqtt *mqtt, const char *server);
 
 void mqtt_set_port(Mqtt *mqtt, int port);
 
+//Failover list, each connect picks the healthiest server
+int mqtt_add_server(Mqtt *mqtt, const char *host, int port);
+
+void mqtt_clear_servers(Mqtt *mqtt);
+
+const MqttServer *mqtt_get_servers(Mqtt *mqtt, int *count);
+
+//connect to the two best servers at once, keep the first one up.
+//The race runs on the event loop, mqtt_connect returns 0 meanwhile.
+void mqtt_set_connect_race(Mqtt *mqtt, bool race);
+
+void mqtt_set_protocol(Mqtt *mqtt, uint8_t protocol);
+
+void mqtt_set_receive_max(Mqtt *mqtt, int receive_max);
+
+//0 takes packets up to 16MB, streamed publishes of any size
+void mqtt_set_max_packet_size(Mqtt *mqtt, int size);
+
+void mqtt_set_topic_alias_max(Mqtt *mqtt, int max);
+
+void mqtt_set_sockopts(Mqtt *mqtt, const MqttSockOpts *opts);
+
+//writes to a broker that went away raise SIGPIPE, ignore it
+int mqtt_set_tls(Mqtt *mqtt, const char *cafile, const char *certfile, const char *keyfile);
+
+bool mqtt_tls_session_resumed(Mqtt *mqtt);
+
 void mqtt_set_retries(Mqtt *mqtt, int retries);
 
 void mqtt_set_will(Mqtt *mqtt, MqttWill *will); 
@@ -186,12 +521,54 @@ void mqtt_set_msg_callback(Mqtt *mqtt, MqttMsgCallback callback);
 
 void mqtt_clear_msg_callback(Mqtt *mqtt);
 
-//MQTT CONNECT
+void mqtt_set_manual_ack(Mqtt *mqtt, bool manual);
+
+void mqtt_set_batch_msg_callback(Mqtt *mqtt, MqttBatchCallback callback, int max_batch);
+
+void mqtt_clear_batch_msg_callback(Mqtt *mqtt);
+
+void mqtt_set_stream_callback(Mqtt *mqtt, MqttStreamCallback callback, int threshold);
+
+void mqtt_clear_stream_callback(Mqtt *mqtt);
+
+//Stop and restart reading from the socket. Resuming does not lift the
+//read watermarks or dispatch backpressure, they stop reading on their own.
+void mqtt_pause_reading(Mqtt *mqtt);
+
+void mqtt_resume_reading(Mqtt *mqtt);
+
+//Pause reading while high messages are delivered and not yet done with:
+//callback running, waiting in a batch or with a dispatch worker, or not
+//yet acked in manual ack mode. Resume at low.
+void mqtt_set_read_watermarks(Mqtt *mqtt, int high, int low);
+
+//MQTT CONNECT, returns the socket, 0 while a connect race runs or -1
 int mqtt_connect(Mqtt *mqtt);
 
 //MQTT PUBLISH
 int mqtt_publish(Mqtt *mqtt, MqttMsg *msg);
 
+//PUBLISH borrowed, binary-safe buffers
+int mqtt_publish_raw(Mqtt *mqtt, const char *topic, int topiclen, const char *payload, int payloadlen, uint8_t qos, bool retain);
+
+//PUBLISH a payload gathered from parts
+int mqtt_publish_iov(Mqtt *mqtt, const char *topic, uint8_t qos, const struct iovec *parts, int n);
+
+//PUBLISH with a completion callback
+int mqtt_publish_ex(Mqtt *mqtt, MqttMsg *msg, MqttPublishCallback callback, void *ctx);
+
+void mqtt_set_publish_timeout(Mqtt *mqtt, int timeout);
+
+//PUBLISH with a prepared topic
+MqttTopicHandle *mqtt_topic_prepare(Mqtt *mqtt, const char *topic, uint8_t qos, bool retain);
+
+int mqtt_publish_prepared(MqttTopicHandle *handle, const char *payload, int payloadlen);
+
+void mqtt_topic_release(MqttTopicHandle *handle);
+
+//PUBLISH a file range with sendfile
+int mqtt_publish_fd(Mqtt *mqtt, const char *topic, uint8_t qos, int fd, off_t offset, size_t len, MqttFileCallback callback, void *privdata);
+
 //PUBACK for QOS1, QOS2 
 void mqtt_puback(Mqtt *mqtt, int msgid);
 
@@ -204,6 +581,11 @@ void mqtt_pubrel(Mqtt *mqtt, int msgid);
 //PUBCOMP for QOS_2
 void mqtt_pubcomp(Mqtt *mqtt, int msgid);
 
+//ACK a message in manual ack mode, only id, qos and epoch are used.
+//A message delivered before the last reconnect is not acked, the
+//broker redelivers it.
+void mqtt_ack(Mqtt *mqtt, const MqttMsg *msg);
+
 //SUBSCRIBE
 int mqtt_subscribe(Mqtt *mqtt, const char *topic, uint8_t qos);
 
@@ -213,7 +595,35 @@ int mqtt_unsubscribe(Mqtt *mqtt, const char *topic);
 //PINGREQ
 void mqtt_ping(Mqtt *mqtt);
 
-//DISCONNECT
+//extra pings every interval ms while connected, to sample round trips
+void mqtt_set_ping_probe(Mqtt *mqtt, int interval);
+
+//latency histograms in microseconds, see hist.h
+const struct _MqttHist *mqtt_get_ping_latency(Mqtt *mqtt);
+
+const struct _MqttHist *mqtt_get_publish_latency(Mqtt *mqtt);
+
+void mqtt_reset_latency(Mqtt *mqtt);
+
+//copy of the counters, gauges filled in at the time of the call.
+//Safe to call from any thread, each field is read whole.
+void mqtt_get_stats(Mqtt *mqtt, MqttStats *stats);
+
+//count time spent in callbacks into callback_us, off by default
+void mqtt_set_callback_timing(Mqtt *mqtt, bool on);
+
+//keep timestamps of the last size packet events, 0 stops, see trace.h
+void mqtt_set_trace(Mqtt *mqtt, int size);
+
+int mqtt_trace_dump(Mqtt *mqtt, const char *path);
+
+//record the bytes read and written into a capture file, NULL stops
+int mqtt_set_capture(Mqtt *mqtt, const char *path);
+
+//decode bytes as if read from the socket, to replay captures
+int mqtt_feed(Mqtt *mqtt, const char *buf, int len);
+
+//DISCONNECT, once connected what is queued goes out first, for up to 1s
 void mqtt_disconnect(Mqtt *mqtt);
 
 //RUN Loop
@@ -222,6 +632,9 @@ void mqtt_run(Mqtt *mqtt);
 //RELEASE
 void mqtt_release(Mqtt *mqtt);
 
+//FNV-1a of a topic, stable across runs
+uint32_t mqtt_topic_hash(const char *topic, int len);
+
 //Will create and release
 MqttWill *mqtt_will_new(char *topic, char *msg, bool retain, uint8_t qos);
 
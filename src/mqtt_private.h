@@ -0,0 +1,57 @@
+/* 
+ * mqtt_private.h - client internals for dispatch and mqttc-bench, not installed
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef __MQTT_PRIVATE_H
+#define __MQTT_PRIVATE_H
+
+#include "mqtt.h"
+
+/*
+ * The builders mqtt.c sends with. Without a socket the packet stays in
+ * the output queue, mqtt_output_take hands it back.
+ */
+int mqtt_encode_publish(Mqtt *mqtt, MqttMsg *msg);
+
+void mqtt_encode_subscribe(Mqtt *mqtt, int msgid, const char *topic, uint8_t qos);
+
+void mqtt_encode_connect(Mqtt *mqtt);
+
+//copy up to size queued bytes into buf, NULL skips it, and drop them as written.
+//returns the bytes that were queued
+size_t mqtt_output_take(Mqtt *mqtt, char *buf, size_t size);
+
+//dispatch backpressure, reading stops while full is set
+void mqtt_read_backlog(Mqtt *mqtt, bool full);
+
+//a dispatch worker is done with msg, acked or not
+void mqtt_inbound_release(Mqtt *mqtt, const MqttMsg *msg);
+
+#endif /* __MQTT_PRIVATE_H */
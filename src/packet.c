@@ -64,6 +64,25 @@ _decode_remaining_length(char **buffer, int *count) {
 	return val;
 }
 
+/*
+ * decode remaining length from a buffer that may hold a partial packet.
+ * return -1 when more bytes are needed, -2 when the length is malformed.
+ */
+int
+_peek_remaining_length(const char *buffer, int len, int *count) {
+	int byte;
+	int val = 0, mul = 1;
+	*count = 0;
+	do {
+		if(*count >= 4) return -2;
+		if(*count >= len) return -1;
+		byte = buffer[(*count)++];
+		val += (byte & 127) * mul;
+		mul *= 128;
+	} while ((byte & 128) != 0);
+	return val;
+}
+
 /*
  * read and write header
  */
@@ -169,3 +188,120 @@ _write_payload(char **pptr, const char *payload, int length) {
 	*pptr += length;
 }
 
+/*
+ * write mqtt 5 properties
+ */
+void
+_write_property_byte(char **pptr, uint8_t id, uint8_t value) {
+	_write_char(pptr, id);
+	_write_char(pptr, value);
+}
+
+void
+_write_property_int(char **pptr, uint8_t id, int value) {
+	_write_char(pptr, id);
+	_write_int(pptr, value);
+}
+
+void
+_write_property_int32(char **pptr, uint8_t id, uint32_t value) {
+	_write_char(pptr, id);
+	_write_int(pptr, (value >> 16) & 0xFFFF);
+	_write_int(pptr, value & 0xFFFF);
+}
+
+/*
+ * write property length and the properties encoded by _write_property_*
+ */
+void
+_write_properties(char **pptr, const char *props, int len) {
+	char bytes[4];
+	int count = _encode_remaining_length(bytes, len);
+	_write_remaining_length(pptr, bytes, count);
+	_write_payload(pptr, props, len);
+}
+
+/*
+ * read mqtt 5 properties from at most len bytes, unknown ones are
+ * skipped. return bytes consumed or -1 when malformed.
+ */
+int
+_read_properties(char **pptr, int len, MqttProps *props) {
+	uint8_t id;
+	int count, size, n;
+	char *ptr = *pptr, *end;
+
+	size = _peek_remaining_length(ptr, len, &count);
+	if(size < 0 || count + size > len) return -1;
+	ptr += count;
+	end = ptr + size;
+	while(ptr < end) {
+		id = (uint8_t)_read_char(&ptr);
+		switch(id) {
+		case PROP_PAYLOAD_FORMAT_INDICATOR:
+		case PROP_REQUEST_PROBLEM_INFORMATION:
+		case PROP_REQUEST_RESPONSE_INFORMATION:
+		case PROP_MAXIMUM_QOS:
+		case PROP_RETAIN_AVAILABLE:
+		case PROP_WILDCARD_SUBSCRIPTION_AVAILABLE:
+		case PROP_SUBSCRIPTION_IDENTIFIER_AVAILABLE:
+		case PROP_SHARED_SUBSCRIPTION_AVAILABLE:
+			n = 1;
+			break;
+		case PROP_SERVER_KEEP_ALIVE:
+		case PROP_RECEIVE_MAXIMUM:
+		case PROP_TOPIC_ALIAS_MAXIMUM:
+		case PROP_TOPIC_ALIAS:
+			if(end - ptr < 2) return -1;
+			n = 0;
+			if(id == PROP_SERVER_KEEP_ALIVE) props->server_keepalive = _read_int(&ptr);
+			else if(id == PROP_RECEIVE_MAXIMUM) props->receive_max = _read_int(&ptr);
+			else if(id == PROP_TOPIC_ALIAS_MAXIMUM) props->topic_alias_max = _read_int(&ptr);
+			else props->topic_alias = _read_int(&ptr);
+			break;
+		case PROP_MESSAGE_EXPIRY_INTERVAL:
+		case PROP_SESSION_EXPIRY_INTERVAL:
+		case PROP_WILL_DELAY_INTERVAL:
+		case PROP_MAXIMUM_PACKET_SIZE:
+			if(end - ptr < 4) return -1;
+			n = 0;
+			if(id == PROP_MAXIMUM_PACKET_SIZE) {
+				uint32_t max = (uint32_t)_read_int(&ptr) << 16;
+				max |= (uint32_t)_read_int(&ptr);
+				//no packet can be larger, same as no limit
+				props->max_packet_size = max > 5 + MAX_PAYLOAD_SIZE ? 0 : (int)max;
+			} else {
+				ptr += 4;
+			}
+			break;
+		case PROP_SUBSCRIPTION_IDENTIFIER:
+			if(_peek_remaining_length(ptr, end-ptr, &n) < 0) return -1;
+			break;
+		case PROP_CONTENT_TYPE:
+		case PROP_RESPONSE_TOPIC:
+		case PROP_CORRELATION_DATA:
+		case PROP_ASSIGNED_CLIENT_IDENTIFIER:
+		case PROP_AUTHENTICATION_METHOD:
+		case PROP_AUTHENTICATION_DATA:
+		case PROP_RESPONSE_INFORMATION:
+		case PROP_SERVER_REFERENCE:
+		case PROP_REASON_STRING:
+			if(end - ptr < 2) return -1;
+			n = _read_int(&ptr);
+			break;
+		case PROP_USER_PROPERTY:
+			if(end - ptr < 2) return -1;
+			n = _read_int(&ptr);
+			if(end - ptr < n + 2) return -1;
+			ptr += n;
+			n = _read_int(&ptr);
+			break;
+		default:
+			return -1;
+		}
+		if(end - ptr < n) return -1;
+		ptr += n;
+	}
+	*pptr = end;
+	return count + size;
+}
@@ -37,6 +37,8 @@
 
 #define PROTOCOL_MAGIC "MQIsdp"
 
+#define PROTOCOL_NAME "MQTT"
+
 #define CONNECT 0x10
 #define CONNACK 0x20
 #define PUBLISH 0x30
@@ -51,6 +53,7 @@
 #define PINGREQ 0xC0
 #define PINGRESP 0xD0
 #define DISCONNECT 0xE0
+#define AUTH 0xF0
 
 #define LSB(A) (uint8_t)(A & 0x00FF)
 #define MSB(A) (uint8_t)((A & 0xFF00) >> 8)
@@ -84,10 +87,54 @@
 
 #define MAX_PAYLOAD_SIZE 268435455
 
+/*
+ * MQTT 5 property identifiers
+ */
+#define PROP_PAYLOAD_FORMAT_INDICATOR 0x01
+#define PROP_MESSAGE_EXPIRY_INTERVAL 0x02
+#define PROP_CONTENT_TYPE 0x03
+#define PROP_RESPONSE_TOPIC 0x08
+#define PROP_CORRELATION_DATA 0x09
+#define PROP_SUBSCRIPTION_IDENTIFIER 0x0B
+#define PROP_SESSION_EXPIRY_INTERVAL 0x11
+#define PROP_ASSIGNED_CLIENT_IDENTIFIER 0x12
+#define PROP_SERVER_KEEP_ALIVE 0x13
+#define PROP_AUTHENTICATION_METHOD 0x15
+#define PROP_AUTHENTICATION_DATA 0x16
+#define PROP_REQUEST_PROBLEM_INFORMATION 0x17
+#define PROP_WILL_DELAY_INTERVAL 0x18
+#define PROP_REQUEST_RESPONSE_INFORMATION 0x19
+#define PROP_RESPONSE_INFORMATION 0x1A
+#define PROP_SERVER_REFERENCE 0x1C
+#define PROP_REASON_STRING 0x1F
+#define PROP_RECEIVE_MAXIMUM 0x21
+#define PROP_TOPIC_ALIAS_MAXIMUM 0x22
+#define PROP_TOPIC_ALIAS 0x23
+#define PROP_MAXIMUM_QOS 0x24
+#define PROP_RETAIN_AVAILABLE 0x25
+#define PROP_USER_PROPERTY 0x26
+#define PROP_MAXIMUM_PACKET_SIZE 0x27
+#define PROP_WILDCARD_SUBSCRIPTION_AVAILABLE 0x28
+#define PROP_SUBSCRIPTION_IDENTIFIER_AVAILABLE 0x29
+#define PROP_SHARED_SUBSCRIPTION_AVAILABLE 0x2A
+
+/*
+ * MQTT 5 properties acted on by the client, zero when absent.
+ */
+typedef struct {
+	int receive_max;
+	int max_packet_size;
+	int topic_alias_max;
+	int topic_alias;
+	int server_keepalive;
+} MqttProps;
+
 int _encode_remaining_length(char *buf, int length);
 
 int _decode_remaining_length(char **buf, int *count);
 
+int _peek_remaining_length(const char *buf, int len, int *count);
+
 void _write_header(char **pptr, uint8_t header);
 
 uint8_t _read_header(char **pptr);
@@ -112,5 +159,15 @@ char* _read_string_len(char **pptr, int *len);
 
 void _write_payload(char **pptr, const char *payload, int length);
 
+void _write_property_byte(char **pptr, uint8_t id, uint8_t value);
+
+void _write_property_int(char **pptr, uint8_t id, int value);
+
+void _write_property_int32(char **pptr, uint8_t id, uint32_t value);
+
+void _write_properties(char **pptr, const char *props, int len);
+
+int _read_properties(char **pptr, int len, MqttProps *props);
+
 #endif /* __MQTT_PACKET_H */
 
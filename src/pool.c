@@ -0,0 +1,419 @@
+/* 
+ * pool.c - publish over several connections, with failover
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "ae.h"
+#include "zmalloc.h"
+#include "packet.h"
+#include "mqtt.h"
+#include "pool.h"
+
+typedef struct _PoolPending PoolPending;
+typedef struct _PoolMember PoolMember;
+
+/*
+ * A message kept until it is safe: QoS1/QoS2 until one member
+ * completes it, QoS0 until its bytes are written to the socket.
+ */
+struct _PoolPending {
+	MqttPool *pool;
+	MqttMsg *msg;
+	MqttPublishCallback callback;
+	void *ctx;
+	uint64_t mark; //member's bytes_written once a QoS0 copy is out
+	bool moved; //sent again on another member
+	PoolPending *prev;
+	PoolPending *next;
+};
+
+typedef struct {
+	PoolPending *head;
+	PoolPending *tail;
+} PoolList;
+
+/*
+ * Messages of a member in publish order, the order they move in when
+ * its connection is lost.
+ */
+struct _PoolMember {
+	MqttPool *pool;
+	Mqtt *mqtt;
+	bool rejoining; //back up, left alone while moved messages are out
+	PoolList pending;
+};
+
+struct _MqttPool {
+	MqttPoolRoute route;
+	int size;
+	PoolMember *members;
+	bool closing;
+	int moved; //moved messages not yet done
+	long long published;
+	long long bytes;
+	long long completed;
+	long long failovers;
+	long long failed;
+};
+
+static void
+_pool_list_push(PoolList *list, PoolPending *pending) {
+	pending->prev = list->tail;
+	pending->next = NULL;
+	if(list->tail) {
+		list->tail->next = pending;
+	} else {
+		list->head = pending;
+	}
+	list->tail = pending;
+}
+
+static void
+_pool_list_remove(PoolList *list, PoolPending *pending) {
+	if(pending->prev) {
+		pending->prev->next = pending->next;
+	} else {
+		list->head = pending->next;
+	}
+	if(pending->next) {
+		pending->next->prev = pending->prev;
+	} else {
+		list->tail = pending->prev;
+	}
+}
+
+//still CONNECTED while its lost messages are failed, but fd is gone
+static bool
+_pool_connected(Mqtt *mqtt) {
+	return mqtt->state == MQTT_STATE_CONNECTED && mqtt->fd > 0;
+}
+
+static bool
+_pool_usable(PoolMember *member) {
+	return !member->rejoining && _pool_connected(member->mqtt);
+}
+
+/*
+ * By topic hash the next connected member takes over while the
+ * hashed one is down.
+ */
+static PoolMember *
+_pool_route(MqttPool *pool, const char *topic) {
+	int i, start;
+	PoolMember *member, *best = NULL;
+
+	if(pool->route == MQTT_POOL_HASH) {
+		start = mqtt_topic_hash(topic, strlen(topic)) % pool->size;
+		for(i = 0; i < pool->size; i++) {
+			member = &pool->members[(start + i) % pool->size];
+			if(_pool_usable(member)) return member;
+		}
+		return NULL;
+	}
+	for(i = 0; i < pool->size; i++) {
+		member = &pool->members[i];
+		if(!_pool_usable(member)) continue;
+		if(!best || member->mqtt->output_bytes < best->mqtt->output_bytes ||
+			(member->mqtt->output_bytes == best->mqtt->output_bytes &&
+			 member->mqtt->inflight_count < best->mqtt->inflight_count)) {
+			best = member;
+		}
+	}
+	return best;
+}
+
+/*
+ * Once nothing moved is out, members that came back take their own
+ * topics again.
+ */
+static void
+_pool_rejoin(MqttPool *pool) {
+	int i;
+	for(i = 0; i < pool->size; i++) {
+		pool->members[i].rejoining = false;
+	}
+}
+
+static void
+_pool_free(MqttPool *pool, PoolPending *pending) {
+	if(pending->moved && --pool->moved == 0) _pool_rejoin(pool);
+	mqtt_msg_free(pending->msg);
+	zfree(pending);
+}
+
+static void
+_pool_fail(MqttPool *pool, Mqtt *mqtt, PoolPending *pending, int msgid, int status) {
+	pool->failed++;
+	if(pending->callback) pending->callback(mqtt, msgid, status, pending->ctx);
+	_pool_free(pool, pending);
+}
+
+static void _pool_done(Mqtt *mqtt, int msgid, int status, void *ctx);
+
+/*
+ * QoS0 copies whose bytes left through the socket are done. Only the
+ * head is looked at, the rest wait for older QoS1/QoS2 acks.
+ */
+static void
+_pool_prune(PoolMember *member) {
+	PoolPending *pending;
+	uint64_t written = member->mqtt->stats.bytes_written;
+	while((pending = member->pending.head) && pending->msg->qos == MQTT_QOS0 &&
+		pending->mark <= written) {
+		_pool_list_remove(&member->pending, pending);
+		member->pool->completed++;
+		_pool_free(member->pool, pending);
+	}
+}
+
+static int
+_pool_send(MqttPool *pool, PoolPending *pending) {
+	int msgid;
+	PoolMember *member = _pool_route(pool, pending->msg->topic);
+	if(!member) return MQTT_ERR;
+	pending->msg->id = 0; //a new msgid on the member
+	if(pending->msg->qos == MQTT_QOS0) {
+		//completes once queued, a move sends it quietly
+		msgid = mqtt_publish_ex(member->mqtt, pending->msg, pending->callback, pending->ctx);
+		pending->callback = NULL;
+	} else {
+		msgid = mqtt_publish_ex(member->mqtt, pending->msg, _pool_done, pending);
+	}
+	if(msgid < 0) return MQTT_ERR;
+	pending->mark = member->mqtt->stats.bytes_written + member->mqtt->output_bytes;
+	_pool_prune(member);
+	_pool_list_push(&member->pending, pending);
+	return msgid;
+}
+
+/*
+ * A lost QoS1/QoS2 message stays with its member, it moves with the
+ * others once the member reports the connection down.
+ */
+static void
+_pool_done(Mqtt *mqtt, int msgid, int status, void *ctx) {
+	PoolPending *pending = ctx;
+	PoolMember *member = mqtt->userdata;
+	MqttPool *pool = pending->pool;
+
+	if(status == MQTT_ERR_CONNLOST && !pool->closing) return;
+	_pool_list_remove(&member->pending, pending);
+	if(status != MQTT_OK) {
+		_pool_fail(pool, mqtt, pending, msgid, status);
+		return;
+	}
+	pool->completed++;
+	if(pending->callback) pending->callback(mqtt, msgid, status, pending->ctx);
+	_pool_free(pool, pending);
+}
+
+/*
+ * Hand what the member did not get out to the survivors, in publish
+ * order so that each topic keeps its order.
+ */
+static void
+_pool_member_lost(PoolMember *member) {
+	MqttPool *pool = member->pool;
+	PoolPending *pending;
+
+	_pool_prune(member);
+	while((pending = member->pending.head)) {
+		_pool_list_remove(&member->pending, pending);
+		if(!pending->moved) {
+			pending->moved = true;
+			pool->moved++;
+		}
+		if(pool->closing || _pool_send(pool, pending) < 0) {
+			_pool_fail(pool, member->mqtt, pending, pending->msg->id, MQTT_ERR_CONNLOST);
+			continue;
+		}
+		pool->failovers++;
+	}
+}
+
+static void
+_pool_on_connect(Mqtt *mqtt, void *data, int state) {
+	PoolMember *member = mqtt->userdata;
+	((void) data);
+	if(state == MQTT_STATE_DISCONNECTED) {
+		_pool_member_lost(member);
+	} else if(state == MQTT_STATE_CONNECTED && member->pool->moved > 0 &&
+		member->pool->route == MQTT_POOL_HASH) {
+		//its topics went elsewhere, newer messages must not overtake them
+		member->rejoining = true;
+	}
+}
+
+static char *
+_pool_strndup(const char *s, int len) {
+	char *copy = zmalloc(len + 1);
+	memcpy(copy, s, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+MqttPool *
+mqtt_pool_new(aeEventLoop *el, const char *clientid, int size, MqttPoolRoute route) {
+	int i;
+	size_t len;
+	char *id;
+	MqttPool *pool;
+	PoolMember *member;
+
+	if(size < 1) return NULL;
+	pool = zmalloc(sizeof(MqttPool));
+	pool->route = route;
+	pool->size = size;
+	pool->closing = false;
+	pool->moved = 0;
+	pool->published = 0;
+	pool->bytes = 0;
+	pool->completed = 0;
+	pool->failovers = 0;
+	pool->failed = 0;
+	pool->members = zmalloc(sizeof(PoolMember) * size);
+
+	len = strlen(clientid) + 16;
+	id = zmalloc(len);
+	for(i = 0; i < size; i++) {
+		member = &pool->members[i];
+		member->pool = pool;
+		member->rejoining = false;
+		member->pending.head = NULL;
+		member->pending.tail = NULL;
+		member->mqtt = mqtt_new(el);
+		member->mqtt->userdata = member;
+		snprintf(id, len, "%s-%d", clientid, i);
+		mqtt_set_clientid(member->mqtt, id);
+		mqtt_set_callback(member->mqtt, CONNECT, _pool_on_connect);
+	}
+	zfree(id);
+	return pool;
+}
+
+int
+mqtt_pool_size(MqttPool *pool) {
+	return pool->size;
+}
+
+Mqtt *
+mqtt_pool_member(MqttPool *pool, int member) {
+	if(member < 0 || member >= pool->size) return NULL;
+	return pool->members[member].mqtt;
+}
+
+int
+mqtt_pool_connect(MqttPool *pool) {
+	int i, n = 0;
+	pool->closing = false;
+	for(i = 0; i < pool->size; i++) {
+		if(mqtt_connect(pool->members[i].mqtt) >= 0) n++;
+	}
+	return n;
+}
+
+int
+mqtt_pool_publish(MqttPool *pool, MqttMsg *msg, MqttPublishCallback callback, void *ctx) {
+	int msgid;
+	PoolPending *pending;
+	int payloadlen = msg->payload ? msg->payloadlen : 0;
+
+	pending = zmalloc(sizeof(PoolPending));
+	pending->pool = pool;
+	pending->callback = callback;
+	pending->ctx = ctx;
+	pending->moved = false;
+	pending->msg = mqtt_msg_new(0, msg->qos, msg->retain, false,
+		zstrdup(msg->topic), payloadlen,
+		payloadlen ? _pool_strndup(msg->payload, payloadlen) : NULL);
+	msgid = _pool_send(pool, pending);
+	if(msgid < 0) {
+		mqtt_msg_free(pending->msg);
+		zfree(pending);
+		return MQTT_ERR;
+	}
+	pool->published++;
+	pool->bytes += payloadlen;
+	return msgid;
+}
+
+void
+mqtt_pool_stats(MqttPool *pool, MqttPoolStats *stats) {
+	int i;
+	Mqtt *mqtt;
+	memset(stats, 0, sizeof(MqttPoolStats));
+	for(i = 0; i < pool->size; i++) {
+		mqtt = pool->members[i].mqtt;
+		if(!_pool_connected(mqtt)) continue;
+		stats->connected++;
+		stats->queued += mqtt->output_bytes;
+		stats->inflight += mqtt->inflight_count;
+	}
+	stats->published = pool->published;
+	stats->bytes = pool->bytes;
+	stats->completed = pool->completed;
+	stats->failovers = pool->failovers;
+	stats->failed = pool->failed;
+}
+
+/*
+ * Closing, a member going down fails its messages instead of moving
+ * them to the others still up.
+ */
+void
+mqtt_pool_disconnect(MqttPool *pool) {
+	int i;
+	pool->closing = true;
+	for(i = 0; i < pool->size; i++) {
+		mqtt_disconnect(pool->members[i].mqtt);
+	}
+}
+
+void
+mqtt_pool_release(MqttPool *pool) {
+	int i;
+	PoolMember *member;
+	PoolPending *pending;
+	pool->closing = true;
+	for(i = 0; i < pool->size; i++) {
+		member = &pool->members[i];
+		if(_pool_connected(member->mqtt)) mqtt_disconnect(member->mqtt);
+		mqtt_release(member->mqtt);
+		//QoS0 copies, their callbacks already ran
+		while((pending = member->pending.head)) {
+			_pool_list_remove(&member->pending, pending);
+			_pool_free(pool, pending);
+		}
+	}
+	zfree(pool->members);
+	zfree(pool);
+}
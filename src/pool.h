@@ -0,0 +1,88 @@
+/* 
+ * pool.h - publish over several connections
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef __MQTT_POOL_H
+#define __MQTT_POOL_H
+
+#include "ae.h"
+#include "mqtt.h"
+
+typedef struct _MqttPool MqttPool;
+
+typedef enum {
+	MQTT_POOL_HASH = 0,   //by topic, keeps per topic order
+	MQTT_POOL_LEAST_QUEUED //to the connection with the fewest bytes queued
+} MqttPoolRoute;
+
+typedef struct {
+	int connected;
+	size_t queued;      //bytes waiting in the output queues
+	int inflight;       //QoS1/QoS2 not yet acked
+	long long published;
+	long long bytes;
+	long long completed; //QoS0 written to the socket, QoS1/QoS2 acked
+	long long failovers;
+	long long failed;
+} MqttPoolStats;
+
+/*
+ * size connections with client ids <clientid>-<n> on one loop. The
+ * member's userdata and CONNECT callback belong to the pool.
+ */
+MqttPool *mqtt_pool_new(aeEventLoop *el, const char *clientid, int size, MqttPoolRoute route);
+
+int mqtt_pool_size(MqttPool *pool);
+
+//configure a member (server, port, tls...) before connecting
+Mqtt *mqtt_pool_member(MqttPool *pool, int member);
+
+//connect every member, returns how many are connecting
+int mqtt_pool_connect(MqttPool *pool);
+
+/*
+ * Publish on one connected member. Messages are copied and sent again,
+ * in publish order, on another member if theirs is lost: QoS0 ones
+ * not yet written to the socket, QoS1/QoS2 ones not yet acked. With
+ * MQTT_POOL_HASH a member that comes back gets its topics again once
+ * the moved messages are done, so each topic keeps its order.
+ * callback gets the msgid of the member that completed it.
+ */
+int mqtt_pool_publish(MqttPool *pool, MqttMsg *msg, MqttPublishCallback callback, void *ctx);
+
+void mqtt_pool_stats(MqttPool *pool, MqttPoolStats *stats);
+
+//messages not yet done are failed, not moved
+void mqtt_pool_disconnect(MqttPool *pool);
+
+//disconnects first, like mqtt_pool_disconnect
+void mqtt_pool_release(MqttPool *pool);
+
+#endif /* __MQTT_POOL_H */
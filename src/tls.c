@@ -0,0 +1,244 @@
+/* 
+ * tls.c - TLS transport on OpenSSL, with kTLS and session resumption
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#if defined(__sun__)
+#define _POSIX_C_SOURCE 200112L
+#elif defined(__linux__)
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "zmalloc.h"
+#include "mqtt.h"
+#include "tls.h"
+
+struct _MqttTls {
+	SSL_CTX *ctx;
+	SSL *ssl;
+	SSL_SESSION *session; //offered again on reconnect
+	bool ktls_send;
+};
+
+static void
+_tls_set_error(char *err, const char *fmt, ...) {
+	va_list ap;
+	size_t len;
+	if(!err) return;
+	va_start(ap, fmt);
+	vsnprintf(err, 1024, fmt, ap);
+	va_end(ap);
+	len = strlen(err);
+	if(ERR_peek_last_error() && len < 1000) {
+		snprintf(err + len, 1024 - len, ": %s",
+			ERR_reason_error_string(ERR_peek_last_error()));
+	}
+	ERR_clear_error();
+}
+
+/*
+ * Keep the newest session, TLS 1.3 tickets arrive after the handshake.
+ */
+static int
+_tls_new_session(SSL *ssl, SSL_SESSION *session) {
+	MqttTls *tls = SSL_get_app_data(ssl);
+	if(tls->session) SSL_SESSION_free(tls->session);
+	tls->session = session;
+	return 1;
+}
+
+MqttTls *
+mqtt_tls_new(char *err, const char *cafile, const char *certfile, const char *keyfile) {
+	MqttTls *tls;
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	if(!ctx) {
+		_tls_set_error(err, "SSL_CTX_new");
+		return NULL;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	if(cafile ? !SSL_CTX_load_verify_locations(ctx, cafile, NULL)
+			: !SSL_CTX_set_default_verify_paths(ctx)) {
+		_tls_set_error(err, "cannot load ca %s", cafile ? cafile : "defaults");
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+	if(certfile && (!SSL_CTX_use_certificate_chain_file(ctx, certfile) ||
+		!SSL_CTX_use_PrivateKey_file(ctx, keyfile ? keyfile : certfile, SSL_FILETYPE_PEM))) {
+		_tls_set_error(err, "cannot load certificate %s", certfile);
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, _tls_new_session);
+
+	tls = zmalloc(sizeof(MqttTls));
+	tls->ctx = ctx;
+	tls->ssl = NULL;
+	tls->session = NULL;
+	tls->ktls_send = false;
+	return tls;
+}
+
+int
+mqtt_tls_connect(MqttTls *tls, char *err, int fd, const char *server) {
+	unsigned char addr[16];
+	bool ip = inet_pton(AF_INET, server, addr) == 1 || inet_pton(AF_INET6, server, addr) == 1;
+
+	mqtt_tls_close(tls);
+	tls->ssl = SSL_new(tls->ctx);
+	SSL_set_app_data(tls->ssl, tls);
+	if(ip) {
+		X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(tls->ssl), server);
+	} else {
+		SSL_set_tlsext_host_name(tls->ssl, server);
+		SSL_set1_host(tls->ssl, server);
+	}
+	if(tls->session && SSL_SESSION_is_resumable(tls->session)) {
+		SSL_set_session(tls->ssl, tls->session);
+	}
+	SSL_set_fd(tls->ssl, fd);
+	if(SSL_connect(tls->ssl) != 1) {
+		_tls_set_error(err, "tls handshake with %s failed", server);
+		//a session the broker refused is not worth offering again
+		if(tls->session) {
+			SSL_SESSION_free(tls->session);
+			tls->session = NULL;
+		}
+		SSL_free(tls->ssl);
+		tls->ssl = NULL;
+		return MQTT_ERR;
+	}
+	tls->ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl));
+	return MQTT_OK;
+}
+
+/*
+ * read(2) semantics: -1 with errno EAGAIN when the socket would block,
+ * 0 on close_notify or EOF.
+ */
+ssize_t
+mqtt_tls_read(MqttTls *tls, void *buf, size_t len) {
+	int n;
+	ERR_clear_error();
+	errno = 0; //SSL_ERROR_SYSCALL with errno 0 is EOF
+	n = SSL_read(tls->ssl, buf, len);
+	if(n > 0) return n;
+	switch(SSL_get_error(tls->ssl, n)) {
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_SYSCALL:
+		if(errno) return -1;
+		return 0;
+	default:
+		errno = EIO;
+		return -1;
+	}
+}
+
+/*
+ * writev(2) semantics. After EAGAIN the same bytes must be passed again,
+ * which the output queue does.
+ */
+ssize_t
+mqtt_tls_writev(MqttTls *tls, const struct iovec *iov, int iovcnt) {
+	int i, n;
+	ssize_t total = 0;
+	for(i = 0; i < iovcnt; i++) {
+		ERR_clear_error();
+		n = SSL_write(tls->ssl, iov[i].iov_base, iov[i].iov_len);
+		if(n <= 0) {
+			if(total > 0) return total;
+			switch(SSL_get_error(tls->ssl, n)) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				errno = EAGAIN;
+				break;
+			case SSL_ERROR_SYSCALL:
+				if(!errno) errno = EPIPE;
+				break;
+			default:
+				errno = EIO;
+			}
+			return -1;
+		}
+		total += n;
+		if((size_t)n < iov[i].iov_len) break;
+	}
+	return total;
+}
+
+bool
+mqtt_tls_connected(MqttTls *tls) {
+	return tls->ssl != NULL;
+}
+
+bool
+mqtt_tls_ktls_send(MqttTls *tls) {
+	return tls->ssl && tls->ktls_send;
+}
+
+bool
+mqtt_tls_resumed(MqttTls *tls) {
+	return tls->ssl && SSL_session_reused(tls->ssl);
+}
+
+void
+mqtt_tls_close(MqttTls *tls) {
+	if(!tls->ssl) return;
+	SSL_shutdown(tls->ssl);
+	SSL_free(tls->ssl);
+	tls->ssl = NULL;
+	tls->ktls_send = false;
+}
+
+void
+mqtt_tls_release(MqttTls *tls) {
+	mqtt_tls_close(tls);
+	if(tls->session) SSL_SESSION_free(tls->session);
+	SSL_CTX_free(tls->ctx);
+	zfree(tls);
+}
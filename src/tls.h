@@ -0,0 +1,64 @@
+/* 
+ * tls.h - TLS transport, handed to kTLS when the kernel can
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef __MQTT_TLS_H
+#define __MQTT_TLS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+typedef struct _MqttTls MqttTls;
+
+MqttTls *mqtt_tls_new(char *err, const char *cafile, const char *certfile, const char *keyfile);
+
+//blocking handshake on a connected socket, resumes the last session
+int mqtt_tls_connect(MqttTls *tls, char *err, int fd, const char *server);
+
+ssize_t mqtt_tls_read(MqttTls *tls, void *buf, size_t len);
+
+ssize_t mqtt_tls_writev(MqttTls *tls, const struct iovec *iov, int iovcnt);
+
+//handshake done, the socket carries TLS records
+bool mqtt_tls_connected(MqttTls *tls);
+
+//records are encrypted by the kernel, plain writes on the socket are fine
+bool mqtt_tls_ktls_send(MqttTls *tls);
+
+//the handshake resumed the cached session
+bool mqtt_tls_resumed(MqttTls *tls);
+
+//send close_notify and free the connection, the session is kept
+void mqtt_tls_close(MqttTls *tls);
+
+void mqtt_tls_release(MqttTls *tls);
+
+#endif /* __MQTT_TLS_H */
@@ -0,0 +1,128 @@
+/* 
+ * trace.c - per packet timestamp ring
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#if defined(__sun__)
+#define _POSIX_C_SOURCE 200112L
+#elif defined(__linux__)
+#define _XOPEN_SOURCE 600
+#else
+#define _XOPEN_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "zmalloc.h"
+#include "trace.h"
+
+static uint64_t
+_trace_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+_trace_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return _trace_ns();
+#endif
+}
+
+MqttTrace *
+mqtt_trace_new(int size) {
+	uint32_t n = 16;
+	MqttTrace *trace;
+	while(n < (uint32_t)size && n < (1U << 30)) n <<= 1;
+	trace = zmalloc(sizeof(MqttTrace));
+	trace->mask = n - 1;
+	trace->head = 0;
+	trace->records = zmalloc(n * sizeof(MqttTraceRecord));
+	trace->start_ns = _trace_ns();
+	trace->start_ticks = _trace_ticks();
+	return trace;
+}
+
+void
+mqtt_trace_record(MqttTrace *trace, int point, int type, int msgid, int len) {
+	uint64_t head = trace->head;
+	MqttTraceRecord *rec = &trace->records[head & trace->mask];
+	rec->ticks = _trace_ticks();
+	rec->point = point;
+	rec->type = type;
+	rec->msgid = msgid;
+	rec->len = len;
+	__atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int
+mqtt_trace_write(MqttTrace *trace, const char *path) {
+	FILE *fp;
+	MqttTraceHeader hdr;
+	uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	uint64_t size = (uint64_t)trace->mask + 1;
+	uint64_t first = head > size ? head - size : 0;
+	uint32_t from = first & trace->mask;
+	uint32_t count = head - first;
+	size_t n;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MQTT_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.record_size = sizeof(MqttTraceRecord);
+	hdr.count = count;
+	hdr.lost = first;
+	hdr.start_ticks = trace->start_ticks;
+	hdr.start_ns = trace->start_ns;
+	hdr.end_ns = _trace_ns();
+	hdr.end_ticks = _trace_ticks();
+
+	if(!(fp = fopen(path, "wb"))) return -1;
+	n = fwrite(&hdr, sizeof(hdr), 1, fp);
+	//oldest first: the tail of the array, then its head
+	if(n == 1 && from + count > size) {
+		n = fwrite(trace->records + from, sizeof(MqttTraceRecord), size - from, fp) == size - from;
+		n = n && fwrite(trace->records, sizeof(MqttTraceRecord),
+			count - (size - from), fp) == count - (size - from);
+	} else if(n == 1) {
+		n = fwrite(trace->records + from, sizeof(MqttTraceRecord), count, fp) == count;
+	}
+	if(fclose(fp) != 0 || n != 1) return -1;
+	return 0;
+}
+
+void
+mqtt_trace_release(MqttTrace *trace) {
+	zfree(trace->records);
+	zfree(trace);
+}
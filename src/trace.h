@@ -0,0 +1,103 @@
+/* 
+ * trace.h - per packet timestamp ring
+ *
+ * Copyright (c) 2013  Ery Lee <ery.lee at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of mqttc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef __MQTT_TRACE_H
+#define __MQTT_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Trace points, in the order a packet goes through them
+ */
+#define MQTT_TRACE_READ 1 //bytes read from the socket
+#define MQTT_TRACE_DECODE 2 //frame found in the read buffer
+#define MQTT_TRACE_HANDLE_START 3 //handling and callbacks begin
+#define MQTT_TRACE_HANDLE_END 4
+#define MQTT_TRACE_ENCODE 5 //packet queued for write
+#define MQTT_TRACE_WRITE 6 //bytes written to the socket
+
+/*
+ * One trace record, 16 bytes. ticks come from the TSC on x86 and are
+ * nanoseconds elsewhere, the dump header converts them.
+ */
+typedef struct {
+	uint64_t ticks;
+	uint8_t point;
+	uint8_t type; //packet type, header >> 4, 0 for socket I/O
+	uint16_t msgid;
+	uint32_t len;
+} MqttTraceRecord;
+
+/*
+ * Ring of the last size records, size a power of two. Written by the
+ * loop thread only and without locks, head is stored with release
+ * order so that a reader on another thread sees whole records.
+ */
+typedef struct _MqttTrace {
+	uint32_t mask;
+	uint64_t head; //records written so far
+	uint64_t start_ticks;
+	uint64_t start_ns;
+	MqttTraceRecord *records;
+} MqttTrace;
+
+/*
+ * Dump file: this header then count records, oldest first, all in host
+ * byte order. Ticks per second is (end_ticks - start_ticks) * 1e9 /
+ * (end_ns - start_ns), the ns clock is CLOCK_MONOTONIC.
+ */
+#define MQTT_TRACE_MAGIC "MQTTTRC1"
+
+typedef struct {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t count;
+	uint64_t lost; //records overwritten before the dump
+	uint64_t start_ticks;
+	uint64_t start_ns;
+	uint64_t end_ticks;
+	uint64_t end_ns;
+} MqttTraceHeader;
+
+#define MQTT_TRACE(trace, point, type, msgid, len) do { \
+	if(trace) mqtt_trace_record(trace, point, type, msgid, len); \
+} while(0)
+
+MqttTrace *mqtt_trace_new(int size);
+
+void mqtt_trace_record(MqttTrace *trace, int point, int type, int msgid, int len);
+
+//write the ring to path, return 0 or -1 with errno set
+int mqtt_trace_write(MqttTrace *trace, const char *path);
+
+void mqtt_trace_release(MqttTrace *trace);
+
+#endif /* __MQTT_TRACE_H */
@@ -57,6 +57,10 @@
 
 static size_t used_memory = 0;
 
+/* zmalloc and zrealloc calls so far, for allocations per op in benchmarks.
+ * Not thread safe, like used_memory. */
+static size_t alloc_count = 0;
+
 static void zmalloc_oom(size_t size) {
     fprintf(stderr, "zmalloc: Out of memory trying to allocate %zu bytes\n",
         size);
@@ -68,6 +72,7 @@ void *zmalloc(size_t size) {
     void *ptr = malloc(size+PREFIX_SIZE);
 
     if (!ptr) zmalloc_oom(size);
+    alloc_count++;
 #ifdef HAVE_MALLOC_SIZE
     increment_used_memory(redis_malloc_size(ptr));
     return ptr;
@@ -86,6 +91,7 @@ void *zrealloc(void *ptr, size_t size) {
     void *newptr;
 
     if (ptr == NULL) return zmalloc(size);
+    alloc_count++;
 #ifdef HAVE_MALLOC_SIZE
     oldsize = redis_malloc_size(ptr);
     newptr = realloc(ptr,size);
@@ -141,3 +147,7 @@ size_t zmalloc_used_memory(void) {
     return um;
 }
 
+size_t zmalloc_alloc_count(void) {
+    return alloc_count;
+}
+
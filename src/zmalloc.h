@@ -36,5 +36,6 @@ void *zrealloc(void *ptr, size_t size);
 void zfree(void *ptr);
 char *zstrdup(const char *s);
 size_t zmalloc_used_memory(void);
+size_t zmalloc_alloc_count(void);
 
 #endif /* _ZMALLOC_H */
@@ -0,0 +1,62 @@
+# TLS broker stand-in for tls_loopback.sh: answers CONNECT with CONNACK
+# and PINGREQ with PINGRESP. The first connection is closed after its
+# CONNACK, so that the client reconnects and offers its session.
+# Prints the port, then one line per connection.
+import socket, ssl, sys, threading, time
+
+cert, key = sys.argv[1], sys.argv[2]
+ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+ctx.load_cert_chain(cert, key)
+
+def packet(sock):
+    header = sock.recv(1)
+    if not header:
+        return None
+    length, shift = 0, 0
+    while True:
+        byte = sock.recv(1)[0]
+        length |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            break
+    body = b''
+    while len(body) < length:
+        chunk = sock.recv(length - len(body))
+        if not chunk:
+            return None
+        body += chunk
+    return header[0] >> 4, body
+
+def serve(sock, first):
+    print('connection resumed=%d' % sock.session_reused, flush=True)
+    try:
+        while True:
+            p = packet(sock)
+            if p is None:
+                break
+            if p[0] == 1:
+                sock.sendall(b'\x20\x02\x00\x00')
+                if first:
+                    time.sleep(0.2)
+                    break
+            elif p[0] == 12:
+                sock.sendall(b'\xd0\x00')
+    except (OSError, IndexError):
+        pass
+    sock.close()
+
+server = socket.socket()
+server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+server.bind(('127.0.0.1', 0))
+server.listen(5)
+print(server.getsockname()[1], flush=True)
+first = True
+while True:
+    conn, _ = server.accept()
+    try:
+        conn = ctx.wrap_socket(conn, server_side=True)
+    except (OSError, ssl.SSLError) as e:
+        print('handshake failed: %s' % e, flush=True)
+        continue
+    threading.Thread(target=serve, args=(conn, first), daemon=True).start()
+    first = False
@@ -0,0 +1,41 @@
+#!/bin/sh
+# TLS loopback: mqttc connects to a local TLS broker stand-in, is
+# dropped after CONNACK and must resume its session on reconnect.
+# usage: tls_loopback.sh path/to/mqttc, built with USE_SSL=1
+# needs openssl and python3.
+
+mqttc=${1:-./mqttc}
+dir=$(mktemp -d)
+broker=
+cleanup() {
+	[ -n "$broker" ] && kill $broker 2>/dev/null
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail() {
+	echo "tls loopback: $1"
+	sed 's/^/  /' "$dir/mqttc.out" "$dir/broker.out" 2>/dev/null
+	exit 1
+}
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+	-addext subjectAltName=IP:127.0.0.1 \
+	-keyout "$dir/key.pem" -out "$dir/cert.pem" >/dev/null 2>&1 ||
+	fail "cannot make a certificate"
+
+python3 "$(dirname "$0")/tls_broker.py" "$dir/cert.pem" "$dir/key.pem" > "$dir/broker.out" &
+broker=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	[ -s "$dir/broker.out" ] && break
+	sleep 0.2
+done
+port=$(head -1 "$dir/broker.out")
+[ -n "$port" ] || fail "broker did not start"
+
+sleep 3 | timeout 3 stdbuf -oL "$mqttc" -h "127.0.0.1:$port" -T "$dir/cert.pem" > "$dir/mqttc.out" 2>&1
+
+grep -q "connected over tls\.$" "$dir/mqttc.out" || fail "no TLS connect"
+grep -q "connected over tls, session resumed" "$dir/mqttc.out" || fail "session not resumed"
+grep -q "resumed=1" "$dir/broker.out" || fail "broker saw no resumption"
+echo "tls loopback: ok"